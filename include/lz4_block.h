@@ -0,0 +1,253 @@
+//
+//  lz4_block.h
+//
+//  A compact, header-only codec for the LZ4 block format
+//  (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md).
+//  Output decodes with LZ4_decompress_safe and vice versa. There is no frame
+//  format, dictionary or high-compression mode: blocks only, a greedy matcher
+//  with one hash table, and a decoder that checks every length and offset
+//  against its buffers.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace lz4
+{
+    // Largest compressed size of `n` bytes, for sizing compress()'s output.
+    inline std::size_t compress_bound(std::size_t n)
+    {
+        return n + n / 255 + 16;
+    }
+
+    namespace detail
+    {
+        static const int kHashLog = 12;
+        static const std::size_t kMinMatch = 4;
+        // The format requires the last match to start at least 12 bytes before the
+        // end of the block, and the last 5 bytes to be literals.
+        static const std::size_t kMfLimit = 12;
+        static const std::size_t kLastLiterals = 5;
+        static const std::size_t kMaxOffset = 65535;
+        // Matches are searched every byte at first, then in growing steps while none
+        // turns up, so incompressible input is skipped quickly.
+        static const unsigned kSkipTrigger = 6;
+
+        inline std::uint32_t read32(const unsigned char *p)
+        {
+            std::uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline std::uint64_t read64(const unsigned char *p)
+        {
+            std::uint64_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline std::uint32_t hash(std::uint32_t sequence)
+        {
+            return (sequence * 2654435761u) >> (32 - kHashLog);
+        }
+
+        // Bytes equal at `a` and `b`, reading no further than `limit` from `a`.
+        inline std::size_t common_length(const unsigned char *a, const unsigned char *b, const unsigned char *limit)
+        {
+            const unsigned char *start = a;
+            while (a + 8 <= limit)
+            {
+                std::uint64_t diff = read64(a) ^ read64(b);
+                if (diff)
+                    return static_cast<std::size_t>(a - start) + (__builtin_ctzll(diff) >> 3);
+                a += 8;
+                b += 8;
+            }
+            while (a < limit && *a == *b)
+            {
+                ++a;
+                ++b;
+            }
+            return static_cast<std::size_t>(a - start);
+        }
+
+        // Writes the 255-run encoding of a length past its token nibble.
+        inline bool put_length(unsigned char *&op, const unsigned char *end, std::size_t length)
+        {
+            while (length >= 255)
+            {
+                if (op >= end)
+                    return false;
+                *op++ = 255;
+                length -= 255;
+            }
+            if (op >= end)
+                return false;
+            *op++ = static_cast<unsigned char>(length);
+            return true;
+        }
+
+        // One sequence: literals, then (unless `match_length` is 0) a match.
+        inline bool put_sequence(unsigned char *&op, const unsigned char *end, const unsigned char *literals,
+                                 std::size_t literal_length, std::size_t offset, std::size_t match_length)
+        {
+            if (op >= end)
+                return false;
+            unsigned char *token = op++;
+            *token = static_cast<unsigned char>((literal_length < 15 ? literal_length : 15) << 4);
+            if (literal_length >= 15 && !put_length(op, end, literal_length - 15))
+                return false;
+            if (literal_length > static_cast<std::size_t>(end - op))
+                return false;
+            std::memcpy(op, literals, literal_length);
+            op += literal_length;
+            if (match_length == 0)
+                return true;
+
+            if (end - op < 2)
+                return false;
+            *op++ = static_cast<unsigned char>(offset);
+            *op++ = static_cast<unsigned char>(offset >> 8);
+            const std::size_t code = match_length - kMinMatch;
+            *token |= static_cast<unsigned char>(code < 15 ? code : 15);
+            return code < 15 || put_length(op, end, code - 15);
+        }
+    }
+
+    // Compresses `n` bytes of `src` into `dst`, which has room for `capacity` bytes.
+    // Returns the compressed size, or 0 if it does not fit.
+    inline std::size_t compress(const char *src, std::size_t n, char *dst, std::size_t capacity)
+    {
+        using namespace detail;
+        const unsigned char *const base = reinterpret_cast<const unsigned char *>(src);
+        const unsigned char *const in_end = base + n;
+        unsigned char *op = reinterpret_cast<unsigned char *>(dst);
+        const unsigned char *const out_end = op + capacity;
+        const unsigned char *anchor = base;
+
+        if (n >= kMfLimit + 1)
+        {
+            std::uint32_t table[1u << kHashLog] = {};
+            const unsigned char *const match_limit = in_end - kLastLiterals;
+            const unsigned char *const search_limit = in_end - kMfLimit;
+            const unsigned char *ip = base;
+            unsigned misses = 1u << kSkipTrigger;
+
+            while (ip < search_limit)
+            {
+                const std::uint32_t sequence = read32(ip);
+                const std::uint32_t h = hash(sequence);
+                const unsigned char *ref = base + table[h];
+                table[h] = static_cast<std::uint32_t>(ip - base);
+                if (ref >= ip || static_cast<std::size_t>(ip - ref) > kMaxOffset || read32(ref) != sequence)
+                {
+                    ip += misses++ >> kSkipTrigger;
+                    continue;
+                }
+                misses = 1u << kSkipTrigger;
+
+                while (ip > anchor && ref > base && ip[-1] == ref[-1])
+                {
+                    --ip;
+                    --ref;
+                }
+                const std::size_t length =
+                    kMinMatch + common_length(ip + kMinMatch, ref + kMinMatch, match_limit);
+                if (!put_sequence(op, out_end, anchor, static_cast<std::size_t>(ip - anchor),
+                                  static_cast<std::size_t>(ip - ref), length))
+                    return 0;
+                ip += length;
+                anchor = ip;
+                // Seed the table from inside the match, so a repeat right after it is found.
+                if (ip < search_limit)
+                    table[hash(read32(ip - 2))] = static_cast<std::uint32_t>(ip - 2 - base);
+            }
+        }
+
+        if (!put_sequence(op, out_end, anchor, static_cast<std::size_t>(in_end - anchor), 0, 0))
+            return 0;
+        return static_cast<std::size_t>(op - reinterpret_cast<unsigned char *>(dst));
+    }
+
+    // Decompresses the block of `n` bytes at `src` into exactly `size` bytes at `dst`.
+    // False if the block is malformed or does not decode to exactly `size` bytes.
+    inline bool decompress(const char *src, std::size_t n, char *dst, std::size_t size)
+    {
+        using namespace detail;
+        const unsigned char *ip = reinterpret_cast<const unsigned char *>(src);
+        const unsigned char *const in_end = ip + n;
+        unsigned char *const out = reinterpret_cast<unsigned char *>(dst);
+        unsigned char *op = out;
+        unsigned char *const out_end = out + size;
+
+        auto get_length = [&ip, in_end](std::size_t &length)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= in_end)
+                    return false;
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+            return true;
+        };
+
+        while (ip < in_end)
+        {
+            const unsigned char token = *ip++;
+            std::size_t literals = token >> 4;
+            if (literals == 15 && !get_length(literals))
+                return false;
+            if (literals > static_cast<std::size_t>(in_end - ip) || literals > static_cast<std::size_t>(out_end - op))
+                return false;
+            // Short runs are copied as one fixed 16 bytes when both buffers have room.
+            if (literals <= 16 && in_end - ip >= 16 && out_end - op >= 16)
+                std::memcpy(op, ip, 16);
+            else
+                std::memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+            if (ip == in_end)
+                return op == out_end;
+
+            if (in_end - ip < 2)
+                return false;
+            const std::size_t offset = ip[0] | (static_cast<std::size_t>(ip[1]) << 8);
+            ip += 2;
+            if (offset == 0 || offset > static_cast<std::size_t>(op - out))
+                return false;
+            std::size_t length = token & 15;
+            if (length == 15 && !get_length(length))
+                return false;
+            length += kMinMatch;
+            if (length > static_cast<std::size_t>(out_end - op))
+                return false;
+
+            const unsigned char *match = op - offset;
+            if (offset >= 8 && static_cast<std::size_t>(out_end - op) >= length + 8)
+            {
+                // 8 bytes at a time, running up to 7 past the match; each chunk reads
+                // only bytes already written, even when the match overlaps itself.
+                for (std::size_t i = 0; i < length; i += 8)
+                    std::memcpy(op + i, match + i, 8);
+                op += length;
+            }
+            else if (offset >= length)
+            {
+                std::memcpy(op, match, length);
+                op += length;
+            }
+            else
+            {
+                // Overlapping copy: the match repeats the bytes it is producing.
+                for (std::size_t i = 0; i < length; ++i)
+                    *op++ = match[i];
+            }
+        }
+        return false;
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <mutex>
+
+// Adaptive cap on concurrent DB-bound operations, after Netflix's gradient2 limiter.
+// Each finished operation reports its latency, including time spent queued for a
+// worker or connection. Every window, the average is compared to a slow-moving
+// baseline. When latency rises above the baseline, MySQL is queueing, so the limit
+// shrinks by the ratio. When latency sits at the baseline, the limit grows by about
+// sqrt(limit). Work over the limit is rejected at once, so under overload MySQL
+// stays at its peak throughput instead of every request waiting in a queue.
+class AdmissionController
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    AdmissionController(std::size_t initial_limit, std::size_t min_limit, std::size_t max_limit)
+        : min_limit(std::max<std::size_t>(1, min_limit)),
+          max_limit(std::max(this->min_limit, max_limit)),
+          estimate(static_cast<double>(std::min(std::max(initial_limit, this->min_limit), this->max_limit))),
+          current_limit(static_cast<std::size_t>(estimate))
+    {
+    }
+
+    AdmissionController(const AdmissionController &) = delete;
+    AdmissionController &operator=(const AdmissionController &) = delete;
+
+    // Claims a slot, or returns false if the operation should be shed.
+    bool try_acquire()
+    {
+        std::size_t current = in_flight.load(std::memory_order_relaxed);
+        do
+        {
+            if (current >= current_limit.load(std::memory_order_relaxed))
+                return false;
+        } while (!in_flight.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+        return true;
+    }
+
+    // Returns a slot and records how long the operation took.
+    void release(Clock::duration latency)
+    {
+        const std::size_t was_in_flight = in_flight.fetch_sub(1, std::memory_order_relaxed);
+        sample(latency, was_in_flight);
+    }
+
+    // Returns a slot whose operation never ran; no latency is recorded.
+    void release() { in_flight.fetch_sub(1, std::memory_order_relaxed); }
+
+    std::size_t limit() const { return current_limit.load(std::memory_order_relaxed); }
+
+private:
+    // Latency is averaged over at least this long and this many samples per update.
+    static constexpr std::chrono::milliseconds kWindow{50};
+    static constexpr std::size_t kMinWindowSamples = 10;
+    // Baseline is an EWMA over roughly this many windows.
+    static constexpr double kBaselineWindows = 100.0;
+    // Latency up to this multiple of the baseline still counts as unloaded.
+    static constexpr double kTolerance = 1.5;
+    static constexpr double kSmoothing = 0.2;
+
+    void sample(Clock::duration latency, std::size_t was_in_flight)
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        const Clock::time_point now = Clock::now();
+        if (window_samples == 0)
+            window_start = now;
+        window_total += latency;
+        ++window_samples;
+        peak_in_flight = std::max(peak_in_flight, was_in_flight);
+        if (window_samples < kMinWindowSamples || now - window_start < kWindow)
+            return;
+
+        const double short_rtt = std::chrono::duration<double>(window_total).count() / window_samples;
+        const std::size_t peak = peak_in_flight;
+        window_total = Clock::duration::zero();
+        window_samples = 0;
+        peak_in_flight = 0;
+
+        if (baseline_rtt <= 0)
+            baseline_rtt = short_rtt;
+        else
+            baseline_rtt += (short_rtt - baseline_rtt) / kBaselineWindows;
+        // After a sustained shift (e.g. load dropped), let the baseline catch up quickly.
+        if (baseline_rtt > 2 * short_rtt)
+            baseline_rtt *= 0.95;
+
+        // Demand never approached the limit, so latency says nothing about raising it.
+        if (peak < estimate / 2)
+            return;
+
+        const double gradient = std::max(0.5, std::min(1.0, kTolerance * baseline_rtt / short_rtt));
+        const double target = estimate * gradient + std::sqrt(estimate);
+        estimate = estimate * (1 - kSmoothing) + target * kSmoothing;
+        estimate = std::min(std::max(estimate, static_cast<double>(min_limit)), static_cast<double>(max_limit));
+        current_limit.store(static_cast<std::size_t>(estimate), std::memory_order_relaxed);
+    }
+
+    const std::size_t min_limit;
+    const std::size_t max_limit;
+
+    std::mutex mu;
+    double estimate; // guarded by mu, published through current_limit
+    double baseline_rtt = 0;
+    Clock::time_point window_start;
+    Clock::duration window_total = Clock::duration::zero();
+    std::size_t window_samples = 0;
+    std::size_t peak_in_flight = 0;
+
+    std::atomic<std::size_t> current_limit;
+    std::atomic<std::size_t> in_flight{0};
+};
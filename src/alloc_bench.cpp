@@ -0,0 +1,139 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <cstdlib>
+#include "lru_cache.h"
+#include "versioned_value.h"
+#include "gzip.h"
+#include "request_arena.h"
+
+using namespace std::chrono;
+
+// Mallocs a request may make inside a Scope: what outlives it, namely the cached
+// value, its LZ4-packed copy, the gzip string and its shared_ptr, the copy a read
+// takes and the unpacked string it serves. Anything more is scratch that escaped
+// the arena, and the bench fails.
+static const std::size_t kMaxArenaMallocs = 6;
+
+// Every malloc in the process, operator new's and zlib's alike. glibc's own entry
+// points do the work.
+static std::atomic<std::size_t> allocations{0};
+
+extern "C"
+{
+    void *__libc_malloc(std::size_t size);
+    void *__libc_calloc(std::size_t count, std::size_t size);
+    void *__libc_realloc(void *p, std::size_t size);
+
+    void *malloc(std::size_t size)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+
+    void *calloc(std::size_t count, std::size_t size)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_calloc(count, size);
+    }
+
+    void *realloc(void *p, std::size_t size)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_realloc(p, size);
+    }
+}
+
+// What KVService does to a value on a write and then a cache hit: gzip it and
+// LZ4-pack it into the cache (compress() and prepare()), then copy the packed bytes
+// back out and unpack them (lookup()). Returns the bytes served.
+static std::size_t serve(LRUCache<std::string, VersionedValue> &cache, const std::string &key,
+                         const std::string &value, std::size_t min_bytes)
+{
+    VersionedValue entry{value, next_version()};
+    std::string gzipped;
+    if (value.size() >= min_bytes && gzip::compress(entry.value, gzipped) &&
+        gzipped.size() <= entry.value.size() - entry.value.size() / 8)
+        entry.gzipped = std::make_shared<const std::string>(std::move(gzipped));
+    pack(entry, min_bytes);
+    cache.put(key, std::move(entry));
+
+    VersionedValue found;
+    cache.visit(key, [&found](const VersionedValue &cached)
+                {
+        found.value = cached.value;
+        found.raw_size = cached.raw_size; });
+    if (!unpack(found))
+        return 0;
+    return found.value.size();
+}
+
+// Replays writes and reads of the same keys, first with the compression scratch
+// on the heap as before, then inside a request_arena::Scope, and reports mallocs
+// per request once the cache and the arena have warmed up. Exits non-zero if a
+// request in a Scope mallocs more than kMaxArenaMallocs times.
+//
+// usage: alloc_bench [requests] [value_bytes] [keys]
+int main(int argc, char **argv)
+{
+    const std::size_t requests = argc > 1 ? std::stoul(argv[1]) : 100000;
+    const std::size_t value_bytes = argc > 2 ? std::stoul(argv[2]) : 4096;
+    const std::size_t keys = argc > 3 ? std::stoul(argv[3]) : 1000;
+    const std::size_t min_bytes = 256;
+
+    std::vector<std::string> names;
+    std::vector<std::string> values;
+    for (std::size_t i = 0; i < keys; ++i)
+    {
+        names.push_back("key" + std::to_string(i));
+        std::string value;
+        while (value.size() < value_bytes)
+            value += "{\"id\":" + std::to_string(i * 7919 + value.size()) + ",\"user\":\"alice\",\"active\":true},";
+        value.resize(value_bytes);
+        values.push_back(std::move(value));
+    }
+
+    std::cout << "Requests: " << requests << ", " << value_bytes << "-byte values over " << keys << " keys"
+              << (gzip::available() ? "" : " (no zlib: gzip skipped)") << "\n";
+    for (bool arena : {false, true})
+    {
+        LRUCache<std::string, VersionedValue> cache(keys, 0);
+        std::size_t served = 0;
+        // Warm-up: fill the cache and let the arena grow its blocks.
+        for (std::size_t i = 0; i < keys; ++i)
+        {
+            std::optional<request_arena::Scope> scope;
+            if (arena)
+                scope.emplace();
+            served += serve(cache, names[i], values[i], min_bytes);
+        }
+
+        const std::size_t before = allocations.load();
+        const auto start = steady_clock::now();
+        for (std::size_t i = 0; i < requests; ++i)
+        {
+            std::optional<request_arena::Scope> scope;
+            if (arena)
+                scope.emplace();
+            served += serve(cache, names[i % keys], values[i % keys], min_bytes);
+        }
+        const std::size_t made = allocations.load() - before;
+        const double ns = duration<double, std::nano>(steady_clock::now() - start).count() / requests;
+        const double per_request = double(made) / requests;
+        std::cout << (arena ? " arena: " : " heap:  ") << per_request << " mallocs, " << ns << " ns per request";
+        if (arena)
+            std::cout << " (" << request_arena::local().capacity() / 1024 << " KiB retained per thread)";
+        std::cout << " (checksum " << served << ")\n";
+        if (arena && made > kMaxArenaMallocs * requests)
+        {
+            std::cerr << "Steady-state requests made " << per_request << " mallocs each with the arena; at most "
+                      << kMaxArenaMallocs << " expected\n";
+            return 1;
+        }
+    }
+    return 0;
+}
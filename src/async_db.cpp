@@ -0,0 +1,486 @@
+#include "async_db.h"
+#include "query_builder.h"
+#include <iostream>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// When statements are in flight, they are all retried this often, however busy
+// the loop's other sockets keep epoll_wait. A statement whose send was cut short
+// by a full socket buffer waits for writability, which the EPOLLIN registration
+// never reports.
+static const std::chrono::milliseconds kRetryInterval{5};
+
+// Client-side error codes (CR_* in errmsg.h) start here; they mean the
+// connection itself is unusable rather than the statement being rejected.
+static const unsigned int kFirstClientError = 2000;
+
+// A lost connection is reopened after a delay that starts here and doubles with
+// each failed attempt, up to the cap, so a MySQL restart is ridden out without
+// hammering the server while it is down.
+static const std::chrono::milliseconds kReconnectMinBackoff{100};
+static const std::chrono::milliseconds kReconnectMaxBackoff{5000};
+
+AsyncDB::AsyncDB(const std::vector<Endpoint> &endpoints, const std::string &user,
+                 const std::string &password, const std::string &dbname,
+                 std::size_t connections_per_endpoint, std::size_t loops)
+    : endpoints_(endpoints), user_(user), password_(password), dbname_(dbname)
+{
+    valid_ = !endpoints.empty();
+    const std::size_t loop_count = loops ? loops : 1;
+    for (std::size_t l = 0; l < loop_count; ++l)
+    {
+        auto loop = std::make_unique<Loop>();
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->epoll_fd < 0 || loop->wake_fd < 0)
+        {
+            std::cerr << "AsyncDB: failed to create epoll/eventfd\n";
+            valid_ = false;
+            loops_.push_back(std::move(loop));
+            continue;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+
+        loop->idle.resize(endpoints.size());
+        loop->waiting.resize(endpoints.size());
+        loop->alive.resize(endpoints.size(), 0);
+        for (std::size_t e = 0; e < endpoints.size(); ++e)
+        {
+            for (std::size_t i = 0; i < connections_per_endpoint; ++i)
+            {
+                auto conn = std::make_unique<Conn>();
+                conn->mysql = nullptr;
+                conn->endpoint = e;
+                MYSQL *mysql = mysql_init(nullptr);
+                if (!mysql)
+                    break;
+                if (!mysql_real_connect(mysql, endpoints[e].host.c_str(), user.c_str(), password.c_str(),
+                                        dbname.c_str(), endpoints[e].port, nullptr, 0))
+                {
+                    std::cerr << "AsyncDB: mysql_real_connect to " << endpoints[e].host << ":" << endpoints[e].port
+                              << " failed: " << mysql_error(mysql) << "\n";
+                    mysql_close(mysql);
+                    // Retried from the loop, like a connection lost later.
+                    retry_later(*conn);
+                    ++loop->down;
+                    loop->conns.push_back(std::move(conn));
+                    continue;
+                }
+                conn->mysql = mysql;
+                // Level-triggered: a busy connection keeps reporting until its reply is consumed.
+                epoll_event cev{};
+                cev.events = EPOLLIN;
+                cev.data.ptr = conn.get();
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, mysql->net.fd, &cev);
+                loop->idle[e].push_back(conn.get());
+                ++loop->alive[e];
+                loop->conns.push_back(std::move(conn));
+            }
+            if (loop->alive[e] == 0)
+                valid_ = false;
+        }
+        loops_.push_back(std::move(loop));
+    }
+
+    for (auto &loop : loops_)
+    {
+        if (loop->epoll_fd >= 0 && loop->wake_fd >= 0)
+            loop->thread = std::thread([this, l = loop.get()]
+                                       { run(*l); });
+    }
+}
+
+AsyncDB::~AsyncDB()
+{
+    stopping_ = true;
+    for (auto &loop : loops_)
+    {
+        if (loop->wake_fd >= 0)
+        {
+            std::uint64_t one = 1;
+            ssize_t ignored = write(loop->wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    for (auto &loop : loops_)
+    {
+        if (loop->thread.joinable())
+            loop->thread.join();
+        for (auto &conn : loop->conns)
+        {
+            if (conn->mysql)
+                mysql_close(conn->mysql);
+        }
+        if (loop->wake_fd >= 0)
+            close(loop->wake_fd);
+        if (loop->epoll_fd >= 0)
+            close(loop->epoll_fd);
+    }
+}
+
+void AsyncDB::submit(std::size_t endpoint, const char *sql, std::vector<std::string> params,
+                     bool fetch_value, Callback done)
+{
+    Loop &loop = *loops_[next_loop_.fetch_add(1, std::memory_order_relaxed) % loops_.size()];
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(loop.incoming_mutex);
+        if (loop.closed)
+        {
+            done(Result{});
+            return;
+        }
+        was_empty = loop.incoming.empty();
+        loop.incoming.push_back(Op{endpoint, sql, std::move(params), fetch_value, std::move(done)});
+    }
+    // One wakeup covers everything queued before the loop drains the batch.
+    if (was_empty)
+    {
+        std::uint64_t one = 1;
+        ssize_t ignored = write(loop.wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void AsyncDB::run(Loop &loop)
+{
+    epoll_event events[64];
+    std::vector<Op> batch;
+    auto next_retry = std::chrono::steady_clock::now() + kRetryInterval;
+    while (!stopping_)
+    {
+        int timeout = -1;
+        if (loop.busy)
+        {
+            const auto left = std::chrono::ceil<std::chrono::milliseconds>(next_retry - std::chrono::steady_clock::now());
+            timeout = static_cast<int>(std::max<std::chrono::milliseconds::rep>(left.count(), 0));
+        }
+        const int reconnect_in = reconnect(loop);
+        if (reconnect_in >= 0 && (timeout < 0 || reconnect_in < timeout))
+            timeout = reconnect_in;
+        int n = epoll_wait(loop.epoll_fd, events, 64, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "AsyncDB: epoll_wait failed\n";
+            break;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            if (!events[i].data.ptr)
+            {
+                std::uint64_t count;
+                ssize_t ignored = read(loop.wake_fd, &count, sizeof(count));
+                (void)ignored;
+                {
+                    std::lock_guard<std::mutex> lock(loop.incoming_mutex);
+                    batch.swap(loop.incoming);
+                }
+                for (Op &op : batch)
+                    dispatch(loop, std::move(op));
+                batch.clear();
+                continue;
+            }
+
+            Conn &conn = *static_cast<Conn *>(events[i].data.ptr);
+            if (!conn.mysql)
+                continue;
+            if (conn.stage == Stage::Idle)
+            {
+                // Nothing is outstanding, so readable means the server closed the connection.
+                std::cerr << "AsyncDB: connection closed while idle\n";
+                drop(loop, conn);
+                continue;
+            }
+            step(loop, conn);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= next_retry)
+        {
+            for (auto &conn : loop.conns)
+            {
+                if (conn->stage == Stage::Query || conn->stage == Stage::Store)
+                    step(loop, *conn);
+            }
+            next_retry = now + kRetryInterval;
+        }
+    }
+
+    // Fail whatever is in flight or still queued so callers are not left waiting.
+    // Once closed, submit() fails at once, including from these callbacks.
+    std::vector<Op> failed;
+    for (auto &conn : loop.conns)
+    {
+        if (conn->stage == Stage::Query || conn->stage == Stage::Store)
+        {
+            failed.push_back(std::move(conn->op));
+            conn->op = Op{};
+            conn->stage = Stage::Idle;
+        }
+    }
+    for (auto &queue : loop.waiting)
+    {
+        for (Op &op : queue)
+            failed.push_back(std::move(op));
+        queue.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(loop.incoming_mutex);
+        batch.swap(loop.incoming);
+        loop.closed = true;
+    }
+    for (Op &op : batch)
+        failed.push_back(std::move(op));
+    for (Op &op : failed)
+        op.done(Result{});
+}
+
+void AsyncDB::dispatch(Loop &loop, Op op)
+{
+    if (op.endpoint >= loop.idle.size() || loop.alive[op.endpoint] == 0)
+    {
+        op.done(Result{});
+        return;
+    }
+    auto &idle = loop.idle[op.endpoint];
+    if (idle.empty())
+    {
+        loop.waiting[op.endpoint].push_back(std::move(op));
+        return;
+    }
+    Conn *conn = idle.back();
+    idle.pop_back();
+    start(loop, *conn, std::move(op));
+}
+
+void AsyncDB::start(Loop &loop, Conn &conn, Op op)
+{
+    build_query(conn.mysql, conn.query, op.sql, op.params);
+    conn.op = std::move(op);
+    conn.stage = Stage::Query;
+    ++loop.busy;
+    step(loop, conn);
+}
+
+void AsyncDB::step(Loop &loop, Conn &conn)
+{
+    if (conn.stage == Stage::Query)
+    {
+        net_async_status status = mysql_real_query_nonblocking(conn.mysql, conn.query.data(), conn.query.size());
+        if (status == NET_ASYNC_NOT_READY)
+            return;
+        if (status == NET_ASYNC_ERROR)
+        {
+            std::cerr << "AsyncDB: query failed: " << mysql_error(conn.mysql) << "\n";
+            if (mysql_errno(conn.mysql) >= kFirstClientError)
+                drop(loop, conn);
+            else
+                finish(loop, conn, Result{});
+            return;
+        }
+        if (!conn.op.fetch_value)
+        {
+            Result result;
+            result.ok = true;
+            result.affected_rows = mysql_affected_rows(conn.mysql);
+            finish(loop, conn, std::move(result));
+            return;
+        }
+        conn.stage = Stage::Store;
+    }
+
+    MYSQL_RES *res = nullptr;
+    net_async_status status = mysql_store_result_nonblocking(conn.mysql, &res);
+    if (status == NET_ASYNC_NOT_READY)
+        return;
+
+    Result result;
+    if (status == NET_ASYNC_ERROR || !res)
+    {
+        std::cerr << "AsyncDB: fetching result failed: " << mysql_error(conn.mysql) << "\n";
+        if (mysql_errno(conn.mysql) >= kFirstClientError)
+            drop(loop, conn);
+        else
+            finish(loop, conn, std::move(result));
+        return;
+    }
+
+    result.ok = true;
+    if (MYSQL_ROW row = mysql_fetch_row(res))
+    {
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        if (row[0])
+            result.value = std::string(row[0], lengths[0]);
+        if (mysql_num_fields(res) > 1 && row[1])
+            result.version = std::strtoull(row[1], nullptr, 10);
+    }
+    mysql_free_result(res);
+    finish(loop, conn, std::move(result));
+}
+
+void AsyncDB::finish(Loop &loop, Conn &conn, Result result)
+{
+    Callback done = std::move(conn.op.done);
+    conn.op = Op{};
+    conn.stage = Stage::Idle;
+    --loop.busy;
+
+    auto &waiting = loop.waiting[conn.endpoint];
+    if (!waiting.empty())
+    {
+        Op next = std::move(waiting.front());
+        waiting.pop_front();
+        start(loop, conn, std::move(next));
+    }
+    else
+    {
+        loop.idle[conn.endpoint].push_back(&conn);
+    }
+
+    done(std::move(result));
+}
+
+void AsyncDB::drop(Loop &loop, Conn &conn)
+{
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, conn.mysql->net.fd, nullptr);
+    mysql_close(conn.mysql);
+    conn.mysql = nullptr;
+    retry_later(conn);
+    ++loop.down;
+
+    auto &idle = loop.idle[conn.endpoint];
+    for (auto it = idle.begin(); it != idle.end(); ++it)
+    {
+        if (*it == &conn)
+        {
+            idle.erase(it);
+            break;
+        }
+    }
+
+    std::vector<Op> failed;
+    if (conn.stage != Stage::Idle)
+    {
+        --loop.busy;
+        conn.stage = Stage::Idle;
+        failed.push_back(std::move(conn.op));
+        conn.op = Op{};
+    }
+    if (--loop.alive[conn.endpoint] == 0)
+    {
+        std::cerr << "AsyncDB: lost every connection to endpoint " << conn.endpoint << "\n";
+        for (Op &op : loop.waiting[conn.endpoint])
+            failed.push_back(std::move(op));
+        loop.waiting[conn.endpoint].clear();
+    }
+    for (Op &op : failed)
+        op.done(Result{});
+}
+
+int AsyncDB::reconnect(Loop &loop)
+{
+    if (!loop.down)
+        return -1;
+    const auto now = std::chrono::steady_clock::now();
+    int wait = -1;
+    for (auto &c : loop.conns)
+    {
+        Conn &conn = *c;
+        if (!conn.mysql && conn.retry_at <= now)
+        {
+            conn.mysql = mysql_init(nullptr);
+            if (!conn.mysql)
+            {
+                retry_later(conn);
+                continue;
+            }
+            conn.stage = Stage::Connect;
+        }
+        if (conn.stage == Stage::Connect)
+            connect_step(loop, conn);
+
+        // A connect in progress is polled like a statement in flight.
+        int due = -1;
+        if (conn.stage == Stage::Connect)
+            due = static_cast<int>(kRetryInterval.count());
+        else if (!conn.mysql)
+            due = static_cast<int>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(conn.retry_at - now).count() + 1);
+        if (due >= 0 && (wait < 0 || due < wait))
+            wait = due;
+    }
+    return wait;
+}
+
+void AsyncDB::connect_step(Loop &loop, Conn &conn)
+{
+    const Endpoint &endpoint = endpoints_[conn.endpoint];
+    net_async_status status = mysql_real_connect_nonblocking(conn.mysql, endpoint.host.c_str(), user_.c_str(),
+                                                             password_.c_str(), dbname_.c_str(), endpoint.port,
+                                                             nullptr, 0);
+    if (status == NET_ASYNC_NOT_READY)
+        return;
+    if (status == NET_ASYNC_ERROR)
+    {
+        mysql_close(conn.mysql);
+        conn.mysql = nullptr;
+        conn.stage = Stage::Idle;
+        retry_later(conn);
+        return;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &conn;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, conn.mysql->net.fd, &ev);
+    conn.stage = Stage::Idle;
+    conn.backoff = std::chrono::milliseconds(0);
+    --loop.down;
+    if (loop.alive[conn.endpoint]++ == 0)
+        std::cerr << "AsyncDB: reconnected to endpoint " << conn.endpoint << "\n";
+
+    auto &waiting = loop.waiting[conn.endpoint];
+    if (!waiting.empty())
+    {
+        Op next = std::move(waiting.front());
+        waiting.pop_front();
+        start(loop, conn, std::move(next));
+    }
+    else
+    {
+        loop.idle[conn.endpoint].push_back(&conn);
+    }
+}
+
+void AsyncDB::retry_later(Conn &conn)
+{
+    conn.backoff = std::min(std::max(conn.backoff * 2, kReconnectMinBackoff), kReconnectMaxBackoff);
+    conn.retry_at = std::chrono::steady_clock::now() + conn.backoff;
+}
+
+void AsyncDB::build_query(MYSQL *mysql, std::string &query, const char *sql, const std::vector<std::string> &params)
+{
+    if (query.capacity() > kMaxRetainedQueryBytes)
+        std::string().swap(query);
+    // Built in the connection's own buffer, so after warm-up this allocates nothing.
+    QueryBuilder builder(mysql, query);
+    std::size_t next_param = 0;
+    const char *run = sql;
+    for (const char *p = sql; *p; ++p)
+    {
+        if (*p != '?' || next_param >= params.size())
+            continue;
+        builder.sql(std::string_view(run, static_cast<std::size_t>(p - run))).quoted(params[next_param++]);
+        run = p + 1;
+    }
+    builder.sql(run);
+}
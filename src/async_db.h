@@ -0,0 +1,126 @@
+#pragma once
+#include <string>
+#include <optional>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <mysql/mysql.h>
+
+// Runs MySQL statements through libmysqlclient's non-blocking API on a few
+// epoll-driven threads. Each loop owns its own connections to every endpoint,
+// so a handful of threads can keep hundreds of statements in flight while the
+// callers return immediately.
+class AsyncDB
+{
+public:
+    struct Endpoint
+    {
+        std::string host;
+        unsigned int port = 3306;
+    };
+
+    struct Result
+    {
+        bool ok = false;
+        // First column of the first row, for statements submitted with fetch_value,
+        // and its second column read as an unsigned integer (0 if absent or NULL).
+        std::optional<std::string> value;
+        std::uint64_t version = 0;
+        std::uint64_t affected_rows = 0;
+    };
+    using Callback = std::function<void(Result)>;
+
+    AsyncDB(const std::vector<Endpoint> &endpoints, const std::string &user,
+            const std::string &password, const std::string &dbname,
+            std::size_t connections_per_endpoint, std::size_t loops);
+    ~AsyncDB();
+
+    AsyncDB(const AsyncDB &) = delete;
+    AsyncDB &operator=(const AsyncDB &) = delete;
+
+    // False if some loop could not open a connection to every endpoint.
+    bool valid() const { return valid_; }
+
+    // Queues `sql` against `endpoint`. Every '?' in `sql` is replaced by the next
+    // element of `params`, escaped and quoted on the connection that runs it.
+    // `done` runs on a loop thread and must not block; it is called exactly once.
+    void submit(std::size_t endpoint, const char *sql, std::vector<std::string> params,
+                bool fetch_value, Callback done);
+
+private:
+    struct Op
+    {
+        std::size_t endpoint;
+        const char *sql;
+        std::vector<std::string> params;
+        bool fetch_value;
+        Callback done;
+    };
+
+    enum class Stage
+    {
+        Idle,
+        Connect,
+        Query,
+        Store
+    };
+
+    // A connection lost to a client error is reopened in place: mysql is nullptr
+    // until retry_at, then Connect while the non-blocking connect runs.
+    struct Conn
+    {
+        MYSQL *mysql;
+        std::size_t endpoint;
+        Stage stage = Stage::Idle;
+        Op op;
+        std::string query;
+        std::chrono::steady_clock::time_point retry_at{};
+        std::chrono::milliseconds backoff{0};
+    };
+
+    struct Loop
+    {
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::thread thread;
+        std::mutex incoming_mutex;
+        std::vector<Op> incoming;
+        std::vector<std::unique_ptr<Conn>> conns;
+        std::vector<std::vector<Conn *>> idle;   // per endpoint
+        std::vector<std::deque<Op>> waiting;     // per endpoint, queued for a free connection
+        std::vector<std::size_t> alive;          // per endpoint, connections not yet dropped
+        std::size_t busy = 0;
+        std::size_t down = 0;                    // connections waiting to reconnect
+        bool closed = false;                     // under incoming_mutex: submit() fails at once
+    };
+
+    void run(Loop &loop);
+    void dispatch(Loop &loop, Op op);
+    void start(Loop &loop, Conn &conn, Op op);
+    void step(Loop &loop, Conn &conn);
+    void finish(Loop &loop, Conn &conn, Result result);
+    void drop(Loop &loop, Conn &conn);
+    // Starts or advances reconnects that are due. Returns the ms until one next
+    // needs attention, or -1 if no connection is down.
+    int reconnect(Loop &loop);
+    void connect_step(Loop &loop, Conn &conn);
+    void retry_later(Conn &conn);
+    // Sets `query` to `sql` with each '?' replaced by the next param, quoted and escaped.
+    void build_query(MYSQL *mysql, std::string &query, const char *sql, const std::vector<std::string> &params);
+
+    std::vector<Endpoint> endpoints_;
+    std::string user_;
+    std::string password_;
+    std::string dbname_;
+    std::vector<std::unique_ptr<Loop>> loops_;
+    std::atomic<std::size_t> next_loop_{0};
+    std::atomic<bool> stopping_{false};
+    bool valid_ = false;
+};
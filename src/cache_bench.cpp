@@ -0,0 +1,105 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "lru_cache.h"
+#include "versioned_value.h"
+
+using namespace std::chrono;
+
+// JSON-ish records like the ones the cache usually holds, roughly `size` bytes.
+static std::string make_value(std::mt19937 &rng, std::size_t size)
+{
+    static const char *const names[] = {"alice", "bob", "carol", "dave", "erin", "frank"};
+    std::string out = "[";
+    while (out.size() < size)
+    {
+        out += "{\"id\":" + std::to_string(rng() % 1000000) + ",\"user\":\"" + names[rng() % 6] +
+               "\",\"active\":" + (rng() % 2 ? "true" : "false") + ",\"score\":" + std::to_string(rng() % 10000) +
+               ",\"tags\":[\"tag" + std::to_string(rng() % 50) + "\"]},";
+    }
+    out.back() = ']';
+    return out;
+}
+
+// Replays a Zipf-distributed stream of reads against a byte-budgeted cache, once
+// with values stored as they are and once with values of at least `min_bytes`
+// LZ4-packed, the way KVService fills and reads its cache, and reports hit rate
+// and CPU time per read. A miss costs only the fill here; in the server it also
+// costs a MySQL round trip.
+//
+// usage: cache_bench [budget_mb] [keys] [reads] [min_bytes]
+int main(int argc, char **argv)
+{
+    const std::size_t budget = (argc > 1 ? std::stoul(argv[1]) : 16) * 1024 * 1024;
+    const std::size_t keys = argc > 2 ? std::stoul(argv[2]) : 20000;
+    const std::size_t reads = argc > 3 ? std::stoul(argv[3]) : 1000000;
+    const std::size_t min_bytes = argc > 4 ? std::stoul(argv[4]) : 256;
+    const double skew = 0.99;
+
+    std::mt19937 rng(42);
+    std::vector<std::string> names;
+    std::vector<std::string> values;
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < keys; ++i)
+    {
+        names.push_back("key" + std::to_string(i));
+        values.push_back(make_value(rng, 512 + rng() % 4096));
+        total += values.back().size();
+    }
+
+    std::vector<double> cdf(keys);
+    double sum = 0;
+    for (std::size_t i = 0; i < keys; ++i)
+        cdf[i] = sum += 1.0 / std::pow(double(i + 1), skew);
+    std::uniform_real_distribution<double> uniform(0, sum);
+    std::vector<std::size_t> stream(reads);
+    for (auto &k : stream)
+        k = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+
+    std::cout << "Keys: " << keys << ", " << total / keys << " bytes per value on average (" << total / (1024 * 1024)
+              << " MiB in all), Zipf " << skew << "\n"
+              << "Cache budget: " << budget / (1024 * 1024) << " MiB, " << reads << " reads\n";
+
+    for (bool packing : {false, true})
+    {
+        LRUCache<std::string, VersionedValue> cache(std::numeric_limits<std::size_t>::max(), budget);
+        std::size_t hits = 0;
+        std::size_t checksum = 0;
+        const auto start = steady_clock::now();
+        for (std::size_t k : stream)
+        {
+            VersionedValue entry;
+            if (cache.visit(names[k], [&entry](const VersionedValue &cached)
+                            {
+                entry.value = cached.value;
+                entry.raw_size = cached.raw_size; }))
+            {
+                ++hits;
+                if (!unpack(entry))
+                {
+                    std::cerr << "Corrupt entry for " << names[k] << "\n";
+                    return 1;
+                }
+            }
+            else
+            {
+                entry.value = values[k];
+                VersionedValue cached = entry;
+                if (packing)
+                    pack(cached, min_bytes);
+                cache.put(names[k], std::move(cached));
+            }
+            checksum += entry.value.size();
+        }
+        const double ns = duration<double, std::nano>(steady_clock::now() - start).count() / reads;
+        const auto counters = cache.counters();
+        std::cout << (packing ? " lz4: " : " raw: ") << "hit rate " << 100.0 * hits / reads << "%, " << counters.entries
+                  << " entries cached, " << ns << " ns/read (checksum " << checksum << ")\n";
+    }
+    return 0;
+}
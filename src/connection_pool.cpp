@@ -0,0 +1,135 @@
+#include "connection_pool.h"
+#include <iostream>
+#include "query_builder.h"
+
+ConnectionPool::Handle::Handle(ConnectionPool *pool_, Connection *conn_)
+    : pool(pool_), conn(conn_)
+{
+}
+
+ConnectionPool::Handle::Handle(Handle &&other) noexcept
+    : pool(other.pool), conn(other.conn)
+{
+    other.pool = nullptr;
+    other.conn = nullptr;
+}
+
+ConnectionPool::Handle &ConnectionPool::Handle::operator=(Handle &&other) noexcept
+{
+    if (this != &other)
+    {
+        if (conn && pool)
+        {
+            pool->release(conn);
+        }
+        pool = other.pool;
+        conn = other.conn;
+        other.pool = nullptr;
+        other.conn = nullptr;
+    }
+    return *this;
+}
+
+ConnectionPool::Handle::~Handle()
+{
+    if (conn && pool)
+    {
+        pool->release(conn);
+    }
+}
+
+ConnectionPool::ConnectionPool(const std::string &host, const std::string &user,
+                               const std::string &password, const std::string &dbname, unsigned int port,
+                               std::size_t pool_size_in)
+    : host_(host), user_(user), password_(password), dbname_(dbname), port_(port), pool_valid(false), pool_size(pool_size_in ? pool_size_in : 1)
+{
+    const std::size_t requested_pool_size = pool_size;
+    for (std::size_t i = 0; i < requested_pool_size; ++i)
+    {
+        MYSQL *conn = create_connection();
+        if (!conn)
+        {
+            std::cerr << "mysql_real_connect failed while building pool for " << host_ << ":" << port_ << "\n";
+            pool_valid = false;
+            break;
+        }
+        all_connections.push_back(std::make_unique<Connection>(Connection{conn, {}}));
+        idle.push_back(all_connections.back().get());
+    }
+
+    pool_size = all_connections.size();
+    idle_count = idle.size();
+
+    pool_valid = idle_count > 0;
+    if (!pool_valid)
+    {
+        std::cerr << "Failed to initialize MySQL connection pool for " << host_ << ":" << port_ << "\n";
+        pool_cv.notify_all();
+    }
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        pool_valid = false;
+    }
+    pool_cv.notify_all();
+
+    for (auto &conn : all_connections)
+    {
+        if (conn->mysql)
+        {
+            mysql_close(conn->mysql);
+        }
+    }
+}
+
+ConnectionPool::Handle ConnectionPool::acquire()
+{
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    pool_cv.wait(lock, [this]
+                 { return idle_count > 0 || !pool_valid; });
+    if (!pool_valid)
+    {
+        return Handle(nullptr, nullptr);
+    }
+    Connection *conn = idle[idle_head];
+    idle_head = (idle_head + 1) % idle.size();
+    --idle_count;
+    lock.unlock();
+    return Handle(this, conn);
+}
+
+void ConnectionPool::release(Connection *conn)
+{
+    if (!conn)
+        return;
+    if (conn->query.capacity() > kMaxRetainedQueryBytes)
+        std::string().swap(conn->query);
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    idle[(idle_head + idle_count) % idle.size()] = conn;
+    ++idle_count;
+    lock.unlock();
+    pool_cv.notify_one();
+}
+
+MYSQL *ConnectionPool::create_connection()
+{
+    MYSQL *conn = mysql_init(nullptr);
+    if (!conn)
+    {
+        std::cerr << "mysql_init failed\n";
+        return nullptr;
+    }
+
+    if (!mysql_real_connect(conn, host_.c_str(), user_.c_str(), password_.c_str(),
+                            dbname_.c_str(), port_, nullptr, 0))
+    {
+        std::cerr << "mysql_real_connect failed: " << mysql_error(conn) << "\n";
+        mysql_close(conn);
+        return nullptr;
+    }
+
+    return conn;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <mysql/mysql.h>
+
+// Fixed-size pool of blocking MySQL connections to a single instance.
+class ConnectionPool
+{
+    struct Connection
+    {
+        MYSQL *mysql;
+        // Reused by every query built on this connection (see QueryBuilder).
+        std::string query;
+    };
+
+public:
+    // Returns its connection to the pool when destroyed.
+    class Handle
+    {
+    public:
+        Handle(ConnectionPool *pool_, Connection *conn_);
+        Handle(const Handle &) = delete;
+        Handle &operator=(const Handle &) = delete;
+        Handle(Handle &&other) noexcept;
+        Handle &operator=(Handle &&other) noexcept;
+        ~Handle();
+        MYSQL *get() const { return conn ? conn->mysql : nullptr; }
+        // The connection's query buffer, which keeps its capacity between acquires.
+        std::string &query() const { return conn->query; }
+
+    private:
+        ConnectionPool *pool;
+        Connection *conn;
+    };
+
+    ConnectionPool(const std::string &host, const std::string &user,
+                   const std::string &password, const std::string &dbname, unsigned int port,
+                   std::size_t pool_size);
+    ~ConnectionPool();
+
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+    // Blocks until a connection is free. The handle is empty if the pool is unusable.
+    Handle acquire();
+    bool valid() const { return pool_valid; }
+    const std::string &host() const { return host_; }
+    unsigned int port() const { return port_; }
+
+private:
+    void release(Connection *conn);
+    MYSQL *create_connection();
+
+    std::string host_;
+    std::string user_;
+    std::string password_;
+    std::string dbname_;
+    unsigned int port_;
+    std::vector<std::unique_ptr<Connection>> all_connections;
+    // Free connections, oldest first, in a ring sized for all of them: acquire and
+    // release never allocate, and every connection keeps being used.
+    std::vector<Connection *> idle;
+    std::size_t idle_head = 0;
+    std::size_t idle_count = 0;
+    std::mutex pool_mutex;
+    std::condition_variable pool_cv;
+    bool pool_valid;
+    std::size_t pool_size;
+};
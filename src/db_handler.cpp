@@ -1,191 +1,566 @@
 #include "db_handler.h"
+#include "query_builder.h"
+#include "request_arena.h"
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <future>
+#include <string_view>
+#include <cstdlib>
+#include <cstring>
 
-DBHandler::ConnectionHandle::ConnectionHandle(DBHandler *handler_, MYSQL *conn_)
-    : handler(handler_), conn(conn_)
-{
-}
+// Virtual nodes per backend on the hash ring. More points even out the key share
+// of each backend at the cost of a slightly larger ring to binary-search.
+static const std::size_t kVirtualNodesPerShard = 160;
 
-DBHandler::ConnectionHandle::ConnectionHandle(ConnectionHandle &&other) noexcept
-    : handler(other.handler), conn(other.conn)
-{
-    other.handler = nullptr;
-    other.conn = nullptr;
-}
+// Bytes of a streamed value collected before each mysql_stmt_send_long_data call;
+// the request body arrives in much smaller reads.
+static const std::size_t kLongDataChunkBytes = 256 * 1024;
 
-DBHandler::ConnectionHandle &DBHandler::ConnectionHandle::operator=(ConnectionHandle &&other) noexcept
+// FNV-1a followed by the MurmurHash3 finalizer, so near-identical inputs such as
+// "host:3306#1" and "host:3306#2" still land far apart on the ring. Stable across
+// processes and builds, unlike std::hash.
+static std::uint64_t ring_hash(const char *data, std::size_t len)
 {
-    if (this != &other)
+    std::uint64_t h = 1469598103934665603ULL;
+    for (std::size_t i = 0; i < len; ++i)
     {
-        if (conn && handler)
-        {
-            handler->release_connection(conn);
-        }
-        handler = other.handler;
-        conn = other.conn;
-        other.handler = nullptr;
-        other.conn = nullptr;
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 1099511628211ULL;
     }
-    return *this;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
-DBHandler::ConnectionHandle::~ConnectionHandle()
+DBHandler::DBHandler(const std::string &host, const std::string &user,
+                     const std::string &password, const std::string &dbname, unsigned int port,
+                     std::size_t pool_size)
+    : DBHandler(std::vector<Backend>{Backend{host, port, {}}}, user, password, dbname, pool_size)
 {
-    if (conn && handler)
-    {
-        handler->release_connection(conn);
-    }
 }
 
-DBHandler::DBHandler(const std::string &host, const std::string &user,
-                     const std::string &password, const std::string &dbname, unsigned int port,
-                     std::size_t pool_size_in)
-    : host_(host), user_(user), password_(password), dbname_(dbname), port_(port), pool_valid(false), pool_size(pool_size_in ? pool_size_in : 1)
+DBHandler::DBHandler(const std::vector<Backend> &backends, const std::string &user,
+                     const std::string &password, const std::string &dbname, std::size_t pool_size,
+                     std::chrono::milliseconds read_your_writes)
+    : recent_writes(read_your_writes), user_(user), password_(password), dbname_(dbname)
 {
-    const std::size_t requested_pool_size = pool_size;
-    for (std::size_t i = 0; i < requested_pool_size; ++i)
+    for (const Backend &backend : backends)
     {
-        MYSQL *conn = create_connection();
-        if (!conn)
+        auto shard = std::make_unique<Shard>();
+        shard->primary = std::make_unique<ConnectionPool>(backend.host, user, password, dbname,
+                                                          backend.port, pool_size);
+        if (shard->primary->valid())
         {
-            std::cerr << "mysql_real_connect failed while building pool\n";
-            pool_valid = false;
-            break;
+            init_schema(*shard->primary);
         }
-        all_connections.push_back(conn);
-        available_connections.push(conn);
+        for (const Backend &replica : backend.replicas)
+        {
+            auto pool = std::make_unique<ConnectionPool>(replica.host, user, password, dbname,
+                                                         replica.port, pool_size);
+            if (pool->valid())
+                shard->replicas.push_back(std::move(pool));
+            else
+                std::cerr << "Skipping unreachable replica " << replica.host << ":" << replica.port << "\n";
+        }
+        has_replicas = has_replicas || !shard->replicas.empty();
+        shards.push_back(std::move(shard));
     }
+    build_ring();
+}
 
-    pool_size = all_connections.size();
-
-    pool_valid = !available_connections.empty();
-    if (!pool_valid)
-    {
-        std::cerr << "Failed to initialize MySQL connection pool\n";
-        pool_cv.notify_all();
-        return;
-    }
+DBHandler::~DBHandler() = default;
 
+void DBHandler::init_schema(ConnectionPool &pool)
+{
     // Ensure table exists using one of the pooled connections.
-    auto conn_handle = acquire_connection();
+    auto conn_handle = pool.acquire();
     if (MYSQL *conn = conn_handle.get())
     {
+        // Binary key collation keeps MySQL's ORDER BY k identical to the byte order
+        // used when merging scans and exports across shards, and NO PAD keeps "a"
+        // and "a " distinct keys. Values are opaque bytes.
         const char *create_table = "CREATE TABLE IF NOT EXISTS kv_store ("
-                                   "k VARCHAR(255) PRIMARY KEY, v TEXT)";
+                                   "k VARCHAR(255) CHARACTER SET utf8mb4 COLLATE utf8mb4_0900_bin PRIMARY KEY, v LONGBLOB, "
+                                   "ver BIGINT UNSIGNED NOT NULL DEFAULT 0)";
         if (!execute_query(conn, create_table))
         {
-            std::cerr << "Failed to create table\n";
+            std::cerr << "Failed to create table on " << pool.host() << ":" << pool.port() << "\n";
+            return;
         }
+        migrate_key_column(conn);
+        migrate_value_column(conn);
+        migrate_version_column(conn);
     }
 }
 
-DBHandler::~DBHandler()
+void DBHandler::migrate_key_column(MYSQL *conn)
 {
-    {
-        std::lock_guard<std::mutex> lock(pool_mutex);
-        pool_valid = false;
-    }
-    pool_cv.notify_all();
+    // Tables created earlier have the schema's default collation, or PAD SPACE
+    // utf8mb4_bin, on kv_store.k. Either breaks the byte order scans merge by.
+    // Moving to a binary NO PAD collation only ever makes keys more distinct, so
+    // the primary key stays unique.
+    const char *collation = "SELECT COLLATION_NAME FROM information_schema.COLUMNS WHERE TABLE_SCHEMA = DATABASE() "
+                            "AND TABLE_NAME = 'kv_store' AND COLUMN_NAME = 'k'";
+    if (!execute_query(conn, collation))
+        return;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res)
+        return;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    const bool is_binary = row && row[0] && std::string(row[0]) == "utf8mb4_0900_bin";
+    mysql_free_result(res);
+    if (is_binary)
+        return;
+
+    std::cout << "Converting kv_store.k to utf8mb4_0900_bin\n";
+    if (!execute_query(conn, "ALTER TABLE kv_store MODIFY k VARCHAR(255) CHARACTER SET utf8mb4 COLLATE utf8mb4_0900_bin NOT NULL"))
+        std::cerr << "Failed to convert kv_store.k to utf8mb4_0900_bin\n";
+}
+
+void DBHandler::migrate_value_column(MYSQL *conn)
+{
+    // Tables created before values became binary have a TEXT column. TEXT to
+    // LONGBLOB keeps the stored bytes as they are.
+    const char *column_type = "SELECT DATA_TYPE FROM information_schema.COLUMNS WHERE TABLE_SCHEMA = DATABASE() "
+                              "AND TABLE_NAME = 'kv_store' AND COLUMN_NAME = 'v'";
+    if (!execute_query(conn, column_type))
+        return;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res)
+        return;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    const bool is_blob = row && row[0] && std::string(row[0]) == "longblob";
+    mysql_free_result(res);
+    if (is_blob)
+        return;
+
+    std::cout << "Converting kv_store.v to LONGBLOB\n";
+    if (!execute_query(conn, "ALTER TABLE kv_store MODIFY v LONGBLOB"))
+        std::cerr << "Failed to convert kv_store.v to LONGBLOB\n";
+}
+
+void DBHandler::migrate_version_column(MYSQL *conn)
+{
+    // Tables created before values were versioned lack kv_store.ver; existing rows
+    // get version 0 until they are next written.
+    const char *has_column = "SELECT COUNT(*) FROM information_schema.COLUMNS WHERE TABLE_SCHEMA = DATABASE() "
+                             "AND TABLE_NAME = 'kv_store' AND COLUMN_NAME = 'ver'";
+    if (!execute_query(conn, has_column))
+        return;
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res)
+        return;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    const bool present = row && row[0] && std::string(row[0]) != "0";
+    mysql_free_result(res);
+    if (present)
+        return;
 
-    for (MYSQL *conn : all_connections)
+    std::cout << "Adding kv_store.ver\n";
+    if (!execute_query(conn, "ALTER TABLE kv_store ADD COLUMN ver BIGINT UNSIGNED NOT NULL DEFAULT 0"))
+        std::cerr << "Failed to add kv_store.ver\n";
+}
+
+void DBHandler::build_ring()
+{
+    ring.clear();
+    if (shards.size() < 2)
+        return;
+
+    ring.reserve(shards.size() * kVirtualNodesPerShard);
+    for (std::size_t i = 0; i < shards.size(); ++i)
     {
-        if (conn)
+        // Points are derived from the address, not the list position, so reordering
+        // the backend list does not move any keys.
+        const ConnectionPool &primary = *shards[i]->primary;
+        const std::string base = primary.host() + ":" + std::to_string(primary.port()) + "#";
+        for (std::size_t v = 0; v < kVirtualNodesPerShard; ++v)
         {
-            mysql_close(conn);
+            const std::string label = base + std::to_string(v);
+            ring.emplace_back(ring_hash(label.data(), label.size()), i);
         }
     }
+    std::sort(ring.begin(), ring.end());
 }
 
-DBHandler::ConnectionHandle DBHandler::acquire_connection()
+std::size_t DBHandler::shard_index(const std::string &key) const
+{
+    if (ring.empty())
+        return 0;
+    const std::uint64_t h = ring_hash(key.data(), key.size());
+    auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(h, std::size_t{0}));
+    if (it == ring.end())
+        it = ring.begin();
+    return it->second;
+}
+
+bool DBHandler::execute_query(MYSQL *conn, const std::string &query)
 {
-    std::unique_lock<std::mutex> lock(pool_mutex);
-    pool_cv.wait(lock, [this]
-                 { return !available_connections.empty() || !pool_valid; });
-    if (!pool_valid)
+    if (!conn)
+        return false;
+    if (mysql_real_query(conn, query.data(), query.size()))
     {
-        return ConnectionHandle(nullptr, nullptr);
+        std::cerr << "Query failed: " << mysql_error(conn) << "\n";
+        return false;
     }
-    MYSQL *conn = available_connections.front();
-    available_connections.pop();
-    lock.unlock();
-    return ConnectionHandle(this, conn);
+    return true;
 }
 
-void DBHandler::release_connection(MYSQL *conn)
+bool DBHandler::put(const std::string &key, const std::string &value, std::uint64_t version)
 {
+    auto handle = shard_for(key).acquire();
+    MYSQL *conn = handle.get();
     if (!conn)
-        return;
-    std::unique_lock<std::mutex> lock(pool_mutex);
-    available_connections.push(conn);
-    lock.unlock();
-    pool_cv.notify_one();
+        return false;
+
+    // Noted before and after: readers must avoid replicas from the moment the write
+    // may be visible on the primary until the lag window after it committed.
+    note_write(key);
+    QueryBuilder query(conn, handle.query());
+    query.sql("INSERT INTO kv_store (k, v, ver) VALUES (").quoted(key).sql(", ").quoted(value).sql(", ").number(version);
+    query.sql(") ON DUPLICATE KEY UPDATE v = VALUES(v), ver = VALUES(ver)");
+    bool ok = execute_query(conn, query.str());
+    note_write(key);
+    return ok;
+}
+
+void DBHandler::note_write(const std::string &key)
+{
+    // Without replicas every read already goes to the primary.
+    if (has_replicas)
+        recent_writes.note(key);
+}
+
+ConnectionPool *DBHandler::replica_for(Shard &shard)
+{
+    if (shard.replicas.empty())
+        return nullptr;
+    const std::size_t n = shard.next_replica.fetch_add(1, std::memory_order_relaxed);
+    return shard.replicas[n % shard.replicas.size()].get();
+}
+
+bool DBHandler::read_from_replica(Shard &shard, const std::string &key)
+{
+    return !shard.replicas.empty() && !recent_writes.contains(key);
+}
+
+std::optional<VersionedValue> DBHandler::get(const std::string &key, bool &failed)
+{
+    return lookup(key, failed);
 }
 
-MYSQL *DBHandler::create_connection()
+std::optional<VersionedValue> DBHandler::lookup(const std::string &key, bool &failed, std::size_t limit,
+                                               std::uint64_t *size)
 {
-    MYSQL *conn = mysql_init(nullptr);
+    Shard &shard = *shards[shard_index(key)];
+    if (read_from_replica(shard, key))
+    {
+        auto result = get_from(*replica_for(shard), key, failed, limit, size);
+        if (!failed)
+            return result;
+        // Fall through to the primary if the replica is unavailable.
+    }
+    return get_from(*shard.primary, key, failed, limit, size);
+}
+
+std::optional<VersionedValue> DBHandler::get_from(ConnectionPool &pool, const std::string &key, bool &failed,
+                                                 std::size_t limit, std::uint64_t *size)
+{
+    failed = true;
+    auto handle = pool.acquire();
+    MYSQL *conn = handle.get();
     if (!conn)
+        return std::nullopt;
+
+    QueryBuilder query(conn, handle.query());
+    if (size)
+        query.sql("SELECT SUBSTRING(v, 1, ").number(limit).sql("), ver, LENGTH(v)");
+    else
+        query.sql("SELECT v, ver");
+    query.sql(" FROM kv_store WHERE k = ").quoted(key).sql(" LIMIT 1");
+    if (mysql_real_query(conn, query.str().data(), query.str().size()))
     {
-        std::cerr << "mysql_init failed\n";
-        return nullptr;
+        std::cerr << "Select query failed: " << mysql_error(conn) << "\n";
+        return std::nullopt;
     }
 
-    if (!mysql_real_connect(conn, host_.c_str(), user_.c_str(), password_.c_str(),
-                            dbname_.c_str(), port_, nullptr, 0))
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res)
+        return std::nullopt;
+
+    failed = false;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    std::optional<VersionedValue> result;
+    if (row && row[0])
     {
-        std::cerr << "mysql_real_connect failed: " << mysql_error(conn) << "\n";
-        mysql_close(conn);
-        return nullptr;
+        // Values may contain NUL bytes, so take the length from the result.
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        result = VersionedValue{std::string(row[0], lengths[0]), row[1] ? std::strtoull(row[1], nullptr, 10) : 0};
+        if (size)
+            *size = row[2] ? std::strtoull(row[2], nullptr, 10) : lengths[0];
     }
+    mysql_free_result(res);
+    return result;
+}
 
-    return conn;
+bool DBHandler::remove(const std::string &key)
+{
+    bool existed = false;
+    return remove(key, existed);
 }
 
-std::string DBHandler::escape(MYSQL *conn, const std::string &str)
+bool DBHandler::remove(const std::string &key, bool &existed)
 {
+    existed = false;
+    auto handle = shard_for(key).acquire();
+    MYSQL *conn = handle.get();
     if (!conn)
-        return {};
-    std::vector<char> buf(str.size() * 2 + 1);
-    unsigned long len = mysql_real_escape_string(conn, buf.data(), str.c_str(), str.size());
-    return std::string(buf.data(), len);
+        return false;
+
+    note_write(key);
+    QueryBuilder query(conn, handle.query());
+    query.sql("DELETE FROM kv_store WHERE k = ").quoted(key);
+    bool ok = execute_query(conn, query.str());
+    if (ok)
+        existed = mysql_affected_rows(conn) > 0;
+    note_write(key);
+    return ok;
 }
 
-bool DBHandler::execute_query(MYSQL *conn, const std::string &query)
+bool DBHandler::update_if(const std::string &key, const std::string &value, std::uint64_t version,
+                          std::optional<std::uint64_t> expected, bool &applied)
+{
+    applied = false;
+    auto handle = shard_for(key).acquire();
+    MYSQL *conn = handle.get();
+    if (!conn)
+        return false;
+
+    note_write(key);
+    // Every write sets a new ver, so a matched row always counts as affected.
+    QueryBuilder query(conn, handle.query());
+    query.sql("UPDATE kv_store SET v = ").quoted(value).sql(", ver = ").number(version).sql(" WHERE k = ").quoted(key);
+    if (expected.has_value())
+        query.sql(" AND ver = ").number(*expected);
+    bool ok = execute_query(conn, query.str());
+    if (ok)
+        applied = mysql_affected_rows(conn) > 0;
+    note_write(key);
+    return ok;
+}
+
+bool DBHandler::insert_if_absent(const std::string &key, const std::string &value, std::uint64_t version,
+                                 bool &applied)
 {
+    applied = false;
+    auto handle = shard_for(key).acquire();
+    MYSQL *conn = handle.get();
     if (!conn)
         return false;
-    if (mysql_query(conn, query.c_str()))
+
+    note_write(key);
+    // "k = k" leaves an existing row untouched and reports 0 affected rows.
+    QueryBuilder query(conn, handle.query());
+    query.sql("INSERT INTO kv_store (k, v, ver) VALUES (").quoted(key).sql(", ").quoted(value).sql(", ").number(version);
+    query.sql(") ON DUPLICATE KEY UPDATE k = k");
+    bool ok = execute_query(conn, query.str());
+    if (ok)
+        applied = mysql_affected_rows(conn) == 1;
+    note_write(key);
+    return ok;
+}
+
+std::optional<VersionedValue> DBHandler::get_latest(const std::string &key, bool &failed)
+{
+    return get_from(shard_for(key), key, failed);
+}
+
+bool DBHandler::put_stream(const std::string &key, std::uint64_t version,
+                           const std::function<bool(const ChunkSink &)> &produce)
+{
+    auto handle = shard_for(key).acquire();
+    MYSQL *conn = handle.get();
+    if (!conn)
+        return false;
+    MYSQL_STMT *stmt = mysql_stmt_init(conn);
+    if (!stmt)
+        return false;
+
+    static const char *const kUpsert =
+        "INSERT INTO kv_store (k, v, ver) VALUES (?, ?, ?) ON DUPLICATE KEY UPDATE v = VALUES(v), ver = VALUES(ver)";
+    unsigned long key_length = key.size();
+    std::uint64_t ver = version;
+    MYSQL_BIND params[3] = {};
+    params[0].buffer_type = MYSQL_TYPE_STRING;
+    params[0].buffer = const_cast<char *>(key.data());
+    params[0].buffer_length = key_length;
+    params[0].length = &key_length;
+    // No buffer: the value arrives as long data.
+    params[1].buffer_type = MYSQL_TYPE_LONG_BLOB;
+    params[2].buffer_type = MYSQL_TYPE_LONGLONG;
+    params[2].buffer = &ver;
+    params[2].is_unsigned = true;
+    if (mysql_stmt_prepare(stmt, kUpsert, std::strlen(kUpsert)) || mysql_stmt_bind_param(stmt, params))
     {
-        std::cerr << "Query failed: " << mysql_error(conn) << "\n";
+        std::cerr << "Prepare failed: " << mysql_stmt_error(stmt) << "\n";
+        mysql_stmt_close(stmt);
         return false;
     }
-    return true;
+
+    // Each piece is appended to the parameter on the server; nothing is executed
+    // until the whole value is there.
+    // The piece being gathered lives in the request arena; the server thread
+    // reuses the same memory upload after upload.
+    request_arena::Buffer chunk(kLongDataChunkBytes);
+    std::size_t filled = 0;
+    auto send = [stmt, &chunk, &filled]()
+    {
+        bool failed = mysql_stmt_send_long_data(stmt, 1, chunk.data(), filled);
+        filled = 0;
+        return !failed;
+    };
+    bool ok = produce([&](const char *data, std::size_t len)
+                      {
+        while (len) {
+            const std::size_t take = std::min(len, chunk.size() - filled);
+            std::memcpy(chunk.data() + filled, data, take);
+            filled += take;
+            data += take;
+            len -= take;
+            if (filled == chunk.size() && !send())
+                return false;
+        }
+        return true; });
+    if (ok && filled)
+        ok = send();
+    if (!ok)
+    {
+        // Closing the statement discards whatever long data was sent.
+        mysql_stmt_close(stmt);
+        return false;
+    }
+
+    note_write(key);
+    ok = mysql_stmt_execute(stmt) == 0;
+    if (!ok)
+        std::cerr << "Streamed insert failed: " << mysql_stmt_error(stmt) << "\n";
+    note_write(key);
+    mysql_stmt_close(stmt);
+    return ok;
 }
 
-bool DBHandler::put(const std::string &key, const std::string &value)
+std::optional<VersionedValue> DBHandler::get_prefix(const std::string &key, std::size_t limit, std::uint64_t &size,
+                                                    bool &failed)
 {
-    auto handle = acquire_connection();
+    return lookup(key, failed, limit, &size);
+}
+
+bool DBHandler::read_range(const std::string &key, std::uint64_t version, std::uint64_t offset, std::size_t length,
+                           std::string &out, bool &matched)
+{
+    // Where get() would read, unless that copy does not have this version yet.
+    Shard &shard = *shards[shard_index(key)];
+    if (read_from_replica(shard, key) && range_from(*replica_for(shard), key, version, offset, length, out, matched) &&
+        matched)
+        return true;
+    return range_from(*shard.primary, key, version, offset, length, out, matched);
+}
+
+bool DBHandler::range_from(ConnectionPool &pool, const std::string &key, std::uint64_t version, std::uint64_t offset,
+                           std::size_t length, std::string &out, bool &matched)
+{
+    matched = false;
+    auto handle = pool.acquire();
     MYSQL *conn = handle.get();
     if (!conn)
         return false;
 
-    std::string query = "INSERT INTO kv_store (k, v) VALUES ('" + escape(conn, key) +
-                        "', '" + escape(conn, value) + "') ON DUPLICATE KEY UPDATE v = VALUES(v)";
-    return execute_query(conn, query);
+    // SUBSTRING counts from 1.
+    QueryBuilder query(conn, handle.query());
+    query.sql("SELECT SUBSTRING(v, ").number(offset + 1).sql(", ").number(length).sql(") FROM kv_store WHERE k = ");
+    query.quoted(key).sql(" AND ver = ").number(version);
+    if (mysql_real_query(conn, query.str().data(), query.str().size()))
+    {
+        std::cerr << "Range query failed: " << mysql_error(conn) << "\n";
+        return false;
+    }
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res)
+        return false;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    if (row && row[0])
+    {
+        matched = true;
+        out.assign(row[0], mysql_fetch_lengths(res)[0]);
+    }
+    mysql_free_result(res);
+    return true;
 }
 
-std::optional<std::string> DBHandler::get(const std::string &key)
+std::optional<std::vector<DBHandler::KVPair>> DBHandler::scan(const std::string &prefix, const std::string &after,
+                                                              std::size_t limit)
 {
-    auto handle = acquire_connection();
+    if (shards.size() == 1)
+        return scan_shard(*shards[0]->primary, prefix, after, limit);
+
+    // Every shard may hold any part of the range, so ask each for a full page in
+    // parallel and keep the smallest `limit` keys of the union.
+    std::vector<std::future<std::optional<std::vector<KVPair>>>> pages;
+    pages.reserve(shards.size());
+    for (auto &shard : shards)
+    {
+        ConnectionPool *pool = shard->primary.get();
+        pages.push_back(std::async(std::launch::async, [this, pool, &prefix, &after, limit]
+                                   { return scan_shard(*pool, prefix, after, limit); }));
+    }
+
+    std::vector<KVPair> rows;
+    bool ok = true;
+    for (auto &page : pages)
+    {
+        auto shard_rows = page.get();
+        if (!shard_rows.has_value())
+        {
+            ok = false;
+            continue;
+        }
+        std::move(shard_rows->begin(), shard_rows->end(), std::back_inserter(rows));
+    }
+    if (!ok)
+        return std::nullopt;
+
+    std::sort(rows.begin(), rows.end(), [](const KVPair &a, const KVPair &b)
+              { return a.first < b.first; });
+    if (rows.size() > limit)
+        rows.resize(limit);
+    return rows;
+}
+
+std::optional<std::vector<DBHandler::KVPair>> DBHandler::scan_shard(ConnectionPool &pool, const std::string &prefix,
+                                                                    const std::string &after, std::size_t limit)
+{
+    auto handle = pool.acquire();
     MYSQL *conn = handle.get();
     if (!conn)
         return std::nullopt;
 
-    std::string query = "SELECT v FROM kv_store WHERE k = '" + escape(conn, key) + "' LIMIT 1";
-    if (mysql_query(conn, query.c_str()))
+    // Keyset pagination: both predicates are ranges on the primary key, so MySQL
+    // seeks straight to the first row instead of skipping an OFFSET.
+    QueryBuilder query(conn, handle.query());
+    query.sql("SELECT k, v FROM kv_store WHERE 1 = 1");
+    if (!prefix.empty())
+        query.sql(" AND k LIKE ").prefix_pattern(prefix);
+    if (!after.empty())
+        query.sql(" AND k > ").quoted(after);
+    query.sql(" ORDER BY k LIMIT ").number(limit);
+
+    if (mysql_real_query(conn, query.str().data(), query.str().size()))
     {
-        std::cerr << "Select query failed: " << mysql_error(conn) << "\n";
+        std::cerr << "Scan query failed: " << mysql_error(conn) << "\n";
         return std::nullopt;
     }
 
@@ -193,23 +568,319 @@ std::optional<std::string> DBHandler::get(const std::string &key)
     if (!res)
         return std::nullopt;
 
-    MYSQL_ROW row = mysql_fetch_row(res);
-    std::optional<std::string> result;
-    if (row && row[0])
+    std::vector<KVPair> rows;
+    rows.reserve(mysql_num_rows(res));
+    while (MYSQL_ROW row = mysql_fetch_row(res))
     {
-        result = std::string(row[0]);
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        if (row[0] && row[1])
+            rows.emplace_back(std::string(row[0], lengths[0]), std::string(row[1], lengths[1]));
     }
     mysql_free_result(res);
-    return result;
+    return rows;
 }
 
-bool DBHandler::remove(const std::string &key)
+bool DBHandler::export_all(const RowCallback &fn)
+{
+    struct Stream
+    {
+        ConnectionPool::Handle handle;
+        MYSQL_RES *res;
+        MYSQL_ROW row;
+        unsigned long *lengths;
+    };
+
+    // One unbuffered result per shard, k-way merged by key. Pools are always
+    // visited in the same order, so concurrent exports cannot deadlock.
+    std::vector<Stream> streams;
+    streams.reserve(shards.size());
+    bool ok = true;
+    for (auto &shard : shards)
+    {
+        streams.push_back(Stream{shard->primary->acquire(), nullptr, nullptr, nullptr});
+        MYSQL *conn = streams.back().handle.get();
+        if (!conn)
+        {
+            ok = false;
+            break;
+        }
+        if (mysql_query(conn, "SELECT k, v FROM kv_store ORDER BY k"))
+        {
+            std::cerr << "Export query failed: " << mysql_error(conn) << "\n";
+            ok = false;
+            break;
+        }
+        // mysql_use_result streams rows off the socket one at a time; InnoDB serves the
+        // SELECT from a consistent snapshot, so writers are not blocked meanwhile.
+        streams.back().res = mysql_use_result(conn);
+        if (!streams.back().res)
+        {
+            ok = false;
+            break;
+        }
+    }
+
+    auto advance = [](Stream &s)
+    {
+        s.row = mysql_fetch_row(s.res);
+        s.lengths = s.row ? mysql_fetch_lengths(s.res) : nullptr;
+    };
+    auto after = [](const Stream *a, const Stream *b)
+    {
+        return std::string_view(a->row[0], a->lengths[0]) > std::string_view(b->row[0], b->lengths[0]);
+    };
+
+    std::vector<Stream *> heap;
+    if (ok)
+    {
+        for (Stream &s : streams)
+        {
+            advance(s);
+            if (s.row)
+                heap.push_back(&s);
+        }
+        std::make_heap(heap.begin(), heap.end(), after);
+    }
+
+    while (ok && !heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), after);
+        Stream *s = heap.back();
+        if (s->row[0] && s->row[1] && !fn(s->row[0], s->lengths[0], s->row[1], s->lengths[1]))
+        {
+            ok = false;
+            break;
+        }
+        advance(*s);
+        if (s->row)
+            std::push_heap(heap.begin(), heap.end(), after);
+        else
+            heap.pop_back();
+    }
+
+    for (Stream &s : streams)
+    {
+        if (!s.res)
+            continue;
+        if (ok && mysql_errno(s.handle.get()))
+        {
+            std::cerr << "Export fetch failed: " << mysql_error(s.handle.get()) << "\n";
+            ok = false;
+        }
+        // Discards any unread rows so the connection can go back to the pool.
+        mysql_free_result(s.res);
+    }
+    return ok;
+}
+
+bool DBHandler::put_batch(const std::vector<KVPair> &pairs)
+{
+    if (pairs.empty())
+        return true;
+
+    std::vector<std::vector<const KVPair *>> groups(shards.size());
+    for (const KVPair &kv : pairs)
+        groups[shard_index(kv.first)].push_back(&kv);
+
+    if (shards.size() == 1)
+        return put_batch_shard(*shards[0]->primary, groups[0]);
+
+    std::vector<std::future<bool>> results;
+    for (std::size_t i = 0; i < shards.size(); ++i)
+    {
+        if (groups[i].empty())
+            continue;
+        results.push_back(std::async(std::launch::async, [this, i, &groups]
+                                     { return put_batch_shard(*shards[i]->primary, groups[i]); }));
+    }
+    bool ok = true;
+    for (auto &result : results)
+        ok = result.get() && ok;
+    return ok;
+}
+
+bool DBHandler::put_batch_shard(ConnectionPool &pool, const std::vector<const KVPair *> &pairs)
 {
-    auto handle = acquire_connection();
+    auto handle = pool.acquire();
     MYSQL *conn = handle.get();
     if (!conn)
         return false;
 
-    std::string query = "DELETE FROM kv_store WHERE k = '" + escape(conn, key) + "'";
-    return execute_query(conn, query);
+    for (const KVPair *kv : pairs)
+        note_write(kv->first);
+    const std::uint64_t version = next_version();
+    QueryBuilder query(conn, handle.query());
+    query.sql("INSERT INTO kv_store (k, v, ver) VALUES ");
+    for (std::size_t i = 0; i < pairs.size(); ++i)
+    {
+        if (i)
+            query.sql(", ");
+        query.sql("(").quoted(pairs[i]->first).sql(", ").quoted(pairs[i]->second).sql(", ").number(version).sql(")");
+    }
+    query.sql(" ON DUPLICATE KEY UPDATE v = VALUES(v), ver = VALUES(ver)");
+    bool ok = execute_query(conn, query.str());
+    for (const KVPair *kv : pairs)
+        note_write(kv->first);
+    return ok;
+}
+
+bool DBHandler::enable_async(std::size_t connections_per_endpoint, std::size_t loops)
+{
+#ifdef KV_HAVE_ASYNC_DB
+    std::vector<AsyncDB::Endpoint> endpoints;
+    for (auto &shard : shards)
+    {
+        shard->async_primary = endpoints.size();
+        endpoints.push_back(AsyncDB::Endpoint{shard->primary->host(), shard->primary->port()});
+        shard->async_replicas.clear();
+        for (auto &replica : shard->replicas)
+        {
+            shard->async_replicas.push_back(endpoints.size());
+            endpoints.push_back(AsyncDB::Endpoint{replica->host(), replica->port()});
+        }
+    }
+    auto async = std::make_unique<AsyncDB>(endpoints, user_, password_, dbname_, connections_per_endpoint, loops);
+    if (!async->valid())
+        return false;
+    async_ = std::move(async);
+    return true;
+#else
+    (void)connections_per_endpoint;
+    (void)loops;
+    std::cerr << "This libmysqlclient has no non-blocking API; async DB mode unavailable\n";
+    return false;
+#endif
+}
+
+// The row an async "SELECT v, ver" found, if any.
+static std::optional<VersionedValue> found(AsyncDB::Result r)
+{
+    if (!r.value.has_value())
+        return std::nullopt;
+    return VersionedValue{std::move(*r.value), r.version};
+}
+
+void DBHandler::get_async(const std::string &key, ValueCallback done)
+{
+    if (!async_)
+    {
+        bool failed = false;
+        auto value = lookup(key, failed);
+        done(!failed, std::move(value));
+        return;
+    }
+
+    static const char *const kSelect = "SELECT v, ver FROM kv_store WHERE k = ? LIMIT 1";
+    Shard &shard = *shards[shard_index(key)];
+    const std::size_t primary = shard.async_primary;
+    if (!read_from_replica(shard, key))
+    {
+        async_->submit(primary, kSelect, {key}, true, [done = std::move(done)](AsyncDB::Result r)
+                       { done(r.ok, found(std::move(r))); });
+        return;
+    }
+
+    const std::size_t n = shard.next_replica.fetch_add(1, std::memory_order_relaxed);
+    const std::size_t replica = shard.async_replicas[n % shard.async_replicas.size()];
+    AsyncDB *async = async_.get();
+    async_->submit(replica, kSelect, {key}, true, [async, primary, key, done = std::move(done)](AsyncDB::Result r) mutable
+                   {
+        if (r.ok) {
+            done(true, found(std::move(r)));
+            return;
+        }
+        // Fall back to the primary if the replica is unavailable.
+        async->submit(primary, kSelect, {key}, true, [done = std::move(done)](AsyncDB::Result pr)
+                      { done(pr.ok, found(std::move(pr))); }); });
+}
+
+void DBHandler::put_async(const std::string &key, const std::string &value, std::uint64_t version, DoneCallback done)
+{
+    if (!async_)
+    {
+        done(put(key, value, version));
+        return;
+    }
+    note_write(key);
+    async_->submit(shards[shard_index(key)]->async_primary,
+                   "INSERT INTO kv_store (k, v, ver) VALUES (?, ?, ?) ON DUPLICATE KEY UPDATE v = VALUES(v), ver = VALUES(ver)",
+                   {key, value, std::to_string(version)}, false, [this, key, done = std::move(done)](AsyncDB::Result r)
+                   {
+        note_write(key);
+        done(r.ok); });
+}
+
+void DBHandler::remove_async(const std::string &key, RemoveCallback done)
+{
+    if (!async_)
+    {
+        bool existed = false;
+        bool ok = remove(key, existed);
+        done(ok, existed);
+        return;
+    }
+    note_write(key);
+    async_->submit(shards[shard_index(key)]->async_primary, "DELETE FROM kv_store WHERE k = ?",
+                   {key}, false, [this, key, done = std::move(done)](AsyncDB::Result r)
+                   {
+        note_write(key);
+        done(r.ok, r.affected_rows > 0); });
+}
+
+void DBHandler::update_if_async(const std::string &key, const std::string &value, std::uint64_t version,
+                                std::optional<std::uint64_t> expected, AppliedCallback done)
+{
+    if (!async_)
+    {
+        bool applied = false;
+        bool ok = update_if(key, value, version, expected, applied);
+        done(ok, applied);
+        return;
+    }
+    note_write(key);
+    std::vector<std::string> params{value, std::to_string(version), key};
+    const char *sql = "UPDATE kv_store SET v = ?, ver = ? WHERE k = ?";
+    if (expected.has_value())
+    {
+        sql = "UPDATE kv_store SET v = ?, ver = ? WHERE k = ? AND ver = ?";
+        params.push_back(std::to_string(*expected));
+    }
+    async_->submit(shards[shard_index(key)]->async_primary, sql, std::move(params), false,
+                   [this, key, done = std::move(done)](AsyncDB::Result r)
+                   {
+        note_write(key);
+        done(r.ok, r.affected_rows > 0); });
+}
+
+void DBHandler::insert_if_absent_async(const std::string &key, const std::string &value, std::uint64_t version,
+                                       AppliedCallback done)
+{
+    if (!async_)
+    {
+        bool applied = false;
+        bool ok = insert_if_absent(key, value, version, applied);
+        done(ok, applied);
+        return;
+    }
+    note_write(key);
+    async_->submit(shards[shard_index(key)]->async_primary,
+                   "INSERT INTO kv_store (k, v, ver) VALUES (?, ?, ?) ON DUPLICATE KEY UPDATE k = k",
+                   {key, value, std::to_string(version)}, false, [this, key, done = std::move(done)](AsyncDB::Result r)
+                   {
+        note_write(key);
+        done(r.ok, r.affected_rows == 1); });
+}
+
+void DBHandler::get_latest_async(const std::string &key, ValueCallback done)
+{
+    if (!async_)
+    {
+        bool failed = false;
+        auto value = get_latest(key, failed);
+        done(!failed, std::move(value));
+        return;
+    }
+    async_->submit(shards[shard_index(key)]->async_primary, "SELECT v, ver FROM kv_store WHERE k = ? LIMIT 1", {key},
+                   true, [done = std::move(done)](AsyncDB::Result r)
+                   { done(r.ok, found(std::move(r))); });
 }
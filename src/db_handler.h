@@ -1,56 +1,153 @@
 #pragma once
 #include <string>
 #include <optional>
-#include <mutex>
-#include <condition_variable>
-#include <queue>
 #include <vector>
+#include <memory>
+#include <utility>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <atomic>
+#include <chrono>
 #include <mysql/mysql.h>
+#include "connection_pool.h"
+#include "recent_writes.h"
+#include "async_db.h"
+#include "versioned_value.h"
 
 class DBHandler
 {
 public:
+    using KVPair = std::pair<std::string, std::string>;
+
+    struct Backend
+    {
+        std::string host;
+        unsigned int port = 3306;
+        // Read replicas of this instance; get() sends reads here unless the key was just written.
+        std::vector<Backend> replicas;
+    };
+
     DBHandler(const std::string &host, const std::string &user,
               const std::string &password, const std::string &dbname, unsigned int port = 3306,
               std::size_t pool_size = 8);
+    // Shards keys across `backends` by consistent hashing; each backend and replica gets its own pool.
+    // Keys written through this handler in the last `read_your_writes` are read from their primary.
+    DBHandler(const std::vector<Backend> &backends, const std::string &user,
+              const std::string &password, const std::string &dbname, std::size_t pool_size = 8,
+              std::chrono::milliseconds read_your_writes = std::chrono::milliseconds(1000));
     ~DBHandler();
 
-    bool put(const std::string &key, const std::string &value);
-    std::optional<std::string> get(const std::string &key);
+    // Every row carries the version it was written with (kv_store.ver).
+    bool put(const std::string &key, const std::string &value, std::uint64_t version);
+    // `failed` is set when MySQL could not be asked, as opposed to the key being absent.
+    std::optional<VersionedValue> get(const std::string &key, bool &failed);
     bool remove(const std::string &key);
+    // As above; `existed` is set to whether a row was actually deleted.
+    bool remove(const std::string &key, bool &existed);
+
+    // Conditional writes, each a single statement on the key's primary. update_if()
+    // rewrites the row only if its version is `expected` (any version when nullopt);
+    // insert_if_absent() only creates a new row. `applied` says whether anything was
+    // written. get_latest() reads the primary, never a replica that may lag it.
+    bool update_if(const std::string &key, const std::string &value, std::uint64_t version,
+                   std::optional<std::uint64_t> expected, bool &applied);
+    bool insert_if_absent(const std::string &key, const std::string &value, std::uint64_t version, bool &applied);
+    std::optional<VersionedValue> get_latest(const std::string &key, bool &failed);
+
+    // Values too large to hold whole, moved in pieces. put_stream() upserts a value
+    // that `produce` hands to its sink chunk by chunk, sent to MySQL as a prepared
+    // statement's long data; `produce` returns false to abandon the write.
+    // get_prefix() is get() that reads at most the first `limit` bytes, with the full
+    // length in `size`. read_range() reads `length` bytes at `offset` of a value still
+    // at `version`; `matched` is false if the key is gone or was rewritten.
+    using ChunkSink = std::function<bool(const char *data, std::size_t len)>;
+    bool put_stream(const std::string &key, std::uint64_t version, const std::function<bool(const ChunkSink &)> &produce);
+    std::optional<VersionedValue> get_prefix(const std::string &key, std::size_t limit, std::uint64_t &size, bool &failed);
+    bool read_range(const std::string &key, std::uint64_t version, std::uint64_t offset, std::size_t length,
+                    std::string &out, bool &matched);
+
+    // Returns up to `limit` pairs whose key starts with `prefix` and sorts strictly after `after`,
+    // in key order. Passing the last key of one page as `after` fetches the next page.
+    std::optional<std::vector<KVPair>> scan(const std::string &prefix, const std::string &after,
+                                            std::size_t limit);
+
+    // Streams every pair to `fn` in primary-key order without buffering the result set.
+    // `fn` returns false to stop early. Returns false if the query failed or was stopped.
+    using RowCallback = std::function<bool(const char *key, std::size_t key_len,
+                                           const char *value, std::size_t value_len)>;
+    bool export_all(const RowCallback &fn);
+
+    // Upserts all pairs with a single multi-row INSERT per shard, under one new version.
+    bool put_batch(const std::vector<KVPair> &pairs);
+
+    std::size_t shard_count() const { return shards.size(); }
+
+    // Switches get_async/put_async/remove_async to the non-blocking client: `loops`
+    // epoll threads, each with `connections_per_endpoint` connections to every
+    // primary and replica. Returns false if unsupported or unreachable.
+    bool enable_async(std::size_t connections_per_endpoint, std::size_t loops);
+    bool async_enabled() const { return async_ != nullptr; }
+
+    // Callback flavours of get/put/remove. With the async client enabled they return
+    // at once and `done` runs on a DB event-loop thread; otherwise they run the
+    // blocking call and invoke `done` before returning. `ok` is false on DB errors.
+    using ValueCallback = std::function<void(bool ok, std::optional<VersionedValue> value)>;
+    using DoneCallback = std::function<void(bool ok)>;
+    using RemoveCallback = std::function<void(bool ok, bool existed)>;
+    using AppliedCallback = std::function<void(bool ok, bool applied)>;
+    void get_async(const std::string &key, ValueCallback done);
+    void put_async(const std::string &key, const std::string &value, std::uint64_t version, DoneCallback done);
+    void remove_async(const std::string &key, RemoveCallback done);
+    void update_if_async(const std::string &key, const std::string &value, std::uint64_t version,
+                         std::optional<std::uint64_t> expected, AppliedCallback done);
+    void insert_if_absent_async(const std::string &key, const std::string &value, std::uint64_t version,
+                                AppliedCallback done);
+    void get_latest_async(const std::string &key, ValueCallback done);
 
 private:
-    struct ConnectionHandle
+    struct Shard
     {
-        DBHandler *handler;
-        MYSQL *conn;
-
-        ConnectionHandle(DBHandler *handler_, MYSQL *conn_);
-        ConnectionHandle(const ConnectionHandle &) = delete;
-        ConnectionHandle &operator=(const ConnectionHandle &) = delete;
-        ConnectionHandle(ConnectionHandle &&other) noexcept;
-        ConnectionHandle &operator=(ConnectionHandle &&other) noexcept;
-        ~ConnectionHandle();
-        MYSQL *get() const { return conn; }
+        std::unique_ptr<ConnectionPool> primary;
+        std::vector<std::unique_ptr<ConnectionPool>> replicas;
+        std::atomic<std::size_t> next_replica{0};
+        // Endpoint ids of this shard inside async_.
+        std::size_t async_primary = 0;
+        std::vector<std::size_t> async_replicas;
     };
 
-    ConnectionHandle acquire_connection();
-    void release_connection(MYSQL *conn);
-    MYSQL *create_connection();
+    void init_schema(ConnectionPool &pool);
+    void migrate_key_column(MYSQL *conn);
+    void migrate_value_column(MYSQL *conn);
+    void migrate_version_column(MYSQL *conn);
+    void build_ring();
+    std::size_t shard_index(const std::string &key) const;
+    ConnectionPool &shard_for(const std::string &key) { return *shards[shard_index(key)]->primary; }
+    ConnectionPool *replica_for(Shard &shard);
+    void note_write(const std::string &key);
+    // With `size`, only the first `limit` bytes of the value are read (see get_prefix).
+    std::optional<VersionedValue> lookup(const std::string &key, bool &failed, std::size_t limit = 0,
+                                         std::uint64_t *size = nullptr);
+    std::optional<VersionedValue> get_from(ConnectionPool &pool, const std::string &key, bool &failed,
+                                           std::size_t limit = 0, std::uint64_t *size = nullptr);
+    bool range_from(ConnectionPool &pool, const std::string &key, std::uint64_t version, std::uint64_t offset,
+                    std::size_t length, std::string &out, bool &matched);
+    bool read_from_replica(Shard &shard, const std::string &key);
+
+    std::optional<std::vector<KVPair>> scan_shard(ConnectionPool &pool, const std::string &prefix,
+                                                  const std::string &after, std::size_t limit);
+    bool put_batch_shard(ConnectionPool &pool, const std::vector<const KVPair *> &pairs);
 
-    std::string escape(MYSQL *conn, const std::string &str);
     bool execute_query(MYSQL *conn, const std::string &query);
 
-    std::string host_;
+    std::vector<std::unique_ptr<Shard>> shards;
+    // Sorted (point, shard) pairs; a key belongs to the first point at or after its hash.
+    std::vector<std::pair<std::uint64_t, std::size_t>> ring;
+    RecentWrites recent_writes;
+    bool has_replicas = false;
+
     std::string user_;
     std::string password_;
     std::string dbname_;
-    unsigned int port_;
-    std::vector<MYSQL *> all_connections;
-    std::queue<MYSQL *> available_connections;
-    std::mutex pool_mutex;
-    std::condition_variable pool_cv;
-    bool pool_valid;
-    std::size_t pool_size;
+    std::unique_ptr<AsyncDB> async_;
 };
@@ -0,0 +1,161 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Binary dump format shared by GET /export and POST /import:
+//
+//   "KVDUMP1\n"                                    magic
+//   { u32 key_len | u32 value_len | key | value }  one record per pair, lengths little-endian
+//   u32 0                                          end marker (keys are never empty)
+namespace dump
+{
+    static const char kMagic[] = "KVDUMP1\n";
+    static const std::size_t kMagicSize = sizeof(kMagic) - 1;
+
+    inline void append_u32(std::string &out, std::uint32_t v)
+    {
+        char buf[4] = {static_cast<char>(v), static_cast<char>(v >> 8),
+                       static_cast<char>(v >> 16), static_cast<char>(v >> 24)};
+        out.append(buf, sizeof(buf));
+    }
+
+    inline std::uint32_t read_u32(const char *p)
+    {
+        const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+        return static_cast<std::uint32_t>(u[0]) | (static_cast<std::uint32_t>(u[1]) << 8) |
+               (static_cast<std::uint32_t>(u[2]) << 16) | (static_cast<std::uint32_t>(u[3]) << 24);
+    }
+
+    inline void append_record(std::string &out, const char *key, std::size_t key_len,
+                              const char *value, std::size_t value_len)
+    {
+        append_u32(out, static_cast<std::uint32_t>(key_len));
+        append_u32(out, static_cast<std::uint32_t>(value_len));
+        out.append(key, key_len);
+        out.append(value, value_len);
+    }
+
+    inline void append_end(std::string &out)
+    {
+        append_u32(out, 0);
+    }
+
+    // Largest record fields a dump may carry: 255 utf8mb4 characters of key, and a
+    // value no bigger than MySQL's highest max_allowed_packet (1 GiB). Anything longer
+    // is rejected as corrupt instead of buffered.
+    static const std::uint32_t kMaxKeyBytes = 255 * 4;
+    static const std::uint32_t kMaxValueBytes = 1024u * 1024 * 1024;
+
+    // Incremental decoder: feed() accepts arbitrary slices of a dump and invokes
+    // on_record(key, key_len, value, value_len) for every complete record. Only the
+    // trailing partial record is buffered between calls; once its size is known the
+    // buffer is reserved for it and later slices are appended in place.
+    class Reader
+    {
+    public:
+        enum class State
+        {
+            Magic,
+            Records,
+            Finished,
+            Corrupt
+        };
+
+        template <typename OnRecord>
+        bool feed(const char *data, std::size_t len, OnRecord &&on_record)
+        {
+            if (state_ == State::Finished || state_ == State::Corrupt)
+            {
+                state_ = State::Corrupt;
+                return false;
+            }
+
+            // Parse in place when nothing is pending; otherwise join with the leftover
+            // bytes, and wait for more while the pending record is still incomplete.
+            const char *p = data;
+            const char *end = data + len;
+            const bool joined = !pending_.empty();
+            if (joined)
+            {
+                pending_.append(data, len);
+                if (pending_.size() < needed_)
+                    return true;
+                p = pending_.data();
+                end = p + pending_.size();
+            }
+            needed_ = 0;
+
+            if (state_ == State::Magic)
+            {
+                if (static_cast<std::size_t>(end - p) < kMagicSize)
+                    return keep(joined, p, end);
+                if (std::memcmp(p, kMagic, kMagicSize) != 0)
+                {
+                    state_ = State::Corrupt;
+                    return false;
+                }
+                p += kMagicSize;
+                state_ = State::Records;
+            }
+
+            while (end - p >= 4)
+            {
+                const std::uint32_t key_len = read_u32(p);
+                if (key_len == 0)
+                {
+                    state_ = (end - p == 4) ? State::Finished : State::Corrupt;
+                    pending_.clear();
+                    return state_ == State::Finished;
+                }
+                if (key_len > kMaxKeyBytes)
+                {
+                    state_ = State::Corrupt;
+                    return false;
+                }
+                if (end - p < 8)
+                    break;
+                const std::uint32_t value_len = read_u32(p + 4);
+                if (value_len > kMaxValueBytes)
+                {
+                    state_ = State::Corrupt;
+                    return false;
+                }
+                const std::size_t record_size = 8 + static_cast<std::size_t>(key_len) + value_len;
+                if (static_cast<std::size_t>(end - p) < record_size)
+                {
+                    needed_ = record_size;
+                    break;
+                }
+                if (!on_record(p + 8, key_len, p + 8 + key_len, value_len))
+                {
+                    state_ = State::Corrupt;
+                    return false;
+                }
+                p += record_size;
+            }
+            return keep(joined, p, end);
+        }
+
+        bool finished() const { return state_ == State::Finished; }
+
+    private:
+        // Holds on to [p, end). When that already lies in pending_, only the consumed
+        // records in front of it are dropped.
+        bool keep(bool joined, const char *p, const char *end)
+        {
+            if (joined)
+                pending_.erase(0, static_cast<std::size_t>(p - pending_.data()));
+            else
+                pending_.assign(p, end);
+            if (needed_ > pending_.size())
+                pending_.reserve(needed_);
+            return true;
+        }
+
+        State state_ = State::Magic;
+        std::string pending_;
+        std::size_t needed_ = 0;
+    };
+}
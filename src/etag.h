@@ -0,0 +1,79 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <optional>
+#include <cstdint>
+#include <cstdio>
+#include <charconv>
+
+// Strong ETags built from value versions, and If-None-Match / If-Match parsing.
+// Shared by the httplib and event-driven front ends. The gzip-encoded form of a
+// value is a different representation, so it gets its own tag: the version's
+// with a "-gz" suffix.
+namespace etag
+{
+    inline std::string format(std::uint64_t version, bool gzipped = false)
+    {
+        char buf[28];
+        int len = std::snprintf(buf, sizeof(buf), gzipped ? "\"%llx-gz\"" : "\"%llx\"",
+                                static_cast<unsigned long long>(version));
+        return std::string(buf, static_cast<std::size_t>(len));
+    }
+
+    // True if `header` (an If-None-Match value: "*" or a comma-separated list of
+    // tags) names `version`, in either encoding. If-None-Match uses weak
+    // comparison, so a W/ prefix is ignored.
+    inline bool none_match_hits(std::string_view header, std::uint64_t version)
+    {
+        const std::string tag = format(version);
+        const std::string gz_tag = format(version, true);
+        std::size_t pos = 0;
+        while (pos < header.size())
+        {
+            std::size_t comma = header.find(',', pos);
+            if (comma == std::string_view::npos)
+                comma = header.size();
+            std::string_view item = header.substr(pos, comma - pos);
+            while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+                item.remove_prefix(1);
+            while (!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+                item.remove_suffix(1);
+            if (item == "*")
+                return true;
+            if (item.size() > 2 && item.compare(0, 2, "W/") == 0)
+                item.remove_prefix(2);
+            if (item == tag || item == gz_tag)
+                return true;
+            pos = comma + 1;
+        }
+        return false;
+    }
+
+    // Reads an If-Match value into the version a compare-and-set must find: nullopt
+    // for "*" (any existing version). Only "*" or a single strong tag is accepted;
+    // weak tags never match under If-Match's strong comparison. A gzip tag names
+    // the same version, so a client that read the value compressed can still write.
+    inline bool parse_if_match(std::string_view header, std::optional<std::uint64_t> &expected)
+    {
+        while (!header.empty() && (header.front() == ' ' || header.front() == '\t'))
+            header.remove_prefix(1);
+        while (!header.empty() && (header.back() == ' ' || header.back() == '\t'))
+            header.remove_suffix(1);
+        if (header == "*")
+        {
+            expected.reset();
+            return true;
+        }
+        if (header.size() < 3 || header.front() != '"' || header.back() != '"')
+            return false;
+        std::string_view hex = header.substr(1, header.size() - 2);
+        if (hex.size() > 3 && hex.compare(hex.size() - 3, 3, "-gz") == 0)
+            hex.remove_suffix(3);
+        std::uint64_t version = 0;
+        auto result = std::from_chars(hex.data(), hex.data() + hex.size(), version, 16);
+        if (result.ec != std::errc() || result.ptr != hex.data() + hex.size())
+            return false;
+        expected = version;
+        return true;
+    }
+}
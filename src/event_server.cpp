@@ -0,0 +1,1849 @@
+#include "event_server.h"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <cctype>
+#include <climits>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <optional>
+#include <string_view>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "httplib.h"
+#include "kv_route.h"
+#include "etag.h"
+#include "gzip.h"
+#ifdef KV_HAVE_IO_URING
+#include "io_uring_ring.h"
+#else
+class IoUring
+{
+};
+#endif
+
+// Requests whose headers or body exceed these limits are rejected and the
+// connection closed, bounding the memory a single client can pin.
+static const std::size_t kMaxHeaderBytes = 8 * 1024;
+static const std::size_t kMaxBodyBytes = 64 * 1024 * 1024;
+// Stop reading from a connection while this much unparsed input is buffered.
+static const std::size_t kMaxBufferedInput = kMaxHeaderBytes + kMaxBodyBytes;
+static const std::size_t kReadChunk = 16 * 1024;
+
+// Longest memcached command line (a multi-get lists every key on one line), and
+// longest RESP inline command or header line.
+static const std::size_t kMaxCommandBytes = 64 * 1024;
+// Most arguments accepted in one RESP command.
+static const std::size_t kMaxRespArgs = 1024 * 1024;
+// memcached reads an <exptime> above this many seconds (30 days) as a Unix time.
+static const long long kMaxRelativeExptime = 60 * 60 * 24 * 30;
+// Requests or commands a connection may have in flight at once.
+static const std::size_t kMaxPipeline = 128;
+// Responses gathered into one sendmsg.
+static const std::size_t kMaxIov = 64;
+
+// Values are opaque bytes.
+static const char *const kValueContentType = "application/octet-stream";
+
+// io_uring mode: ring size and the per-loop pool of recv buffers (kReadChunk each).
+static const unsigned kRingEntries = 1024;
+static const unsigned kRecvBuffers = 512;
+static const std::uint16_t kRecvBufferGroup = 0;
+
+// io_uring user_data carries the connection id above the operation tag.
+static const std::uint64_t kOpAccept = 0;
+static const std::uint64_t kOpWake = 1;
+static const std::uint64_t kOpRecv = 2;
+static const std::uint64_t kOpSend = 3;
+static const int kOpBits = 2;
+
+// The loop running on this thread, so completions raised inline by a handler
+// are applied directly instead of bouncing through the completion queue.
+static thread_local const void *tls_loop = nullptr;
+
+static const char *reason_phrase(int status)
+{
+    switch (status)
+    {
+    case 100:
+        return "Continue";
+    case 200:
+        return "OK";
+    case 201:
+        return "Created";
+    case 304:
+        return "Not Modified";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 409:
+        return "Conflict";
+    case 412:
+        return "Precondition Failed";
+    case 413:
+        return "Payload Too Large";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 501:
+        return "Not Implemented";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+static std::string http_response(int status, const char *content_type, const std::string &body, bool keep_alive,
+                                 const char *extra_headers = "")
+{
+    std::string out;
+    out.reserve(128 + body.size());
+    out += "HTTP/1.1 ";
+    out += std::to_string(status);
+    out += ' ';
+    out += reason_phrase(status);
+    out += "\r\nContent-Type: ";
+    out += content_type;
+    out += "\r\nContent-Length: ";
+    out += std::to_string(body.size());
+    out += "\r\n";
+    out += extra_headers;
+    out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    out += body;
+    return out;
+}
+
+// 304 for a conditional GET: the ETag and Vary a 200 would carry, no body, and no
+// Content-Length, which would have to be the length of the value the client already has.
+static std::string not_modified_response(const std::string &extra_headers, bool keep_alive)
+{
+    std::string out = "HTTP/1.1 304 Not Modified\r\n";
+    out += extra_headers;
+    out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    return out;
+}
+
+// memcached keys: 1-250 bytes with no spaces or control characters.
+static bool valid_memcached_key(std::string_view key)
+{
+    if (key.empty() || key.size() > 250)
+        return false;
+    for (char c : key)
+    {
+        const unsigned char u = static_cast<unsigned char>(c);
+        if (u <= ' ' || u == 0x7f)
+            return false;
+    }
+    return true;
+}
+
+// The TTL a memcached <exptime> sets: seconds from now, or a Unix time if over 30
+// days. A time not in the future expires the key at once.
+static std::chrono::milliseconds memcached_ttl(long long exptime)
+{
+    long long seconds = exptime;
+    if (exptime > kMaxRelativeExptime)
+        seconds = exptime - std::chrono::duration_cast<std::chrono::seconds>(
+                                std::chrono::system_clock::now().time_since_epoch())
+                                .count();
+    if (seconds <= 0)
+        return std::chrono::milliseconds(0);
+    return std::chrono::milliseconds(std::min(seconds, LLONG_MAX / 1000) * 1000);
+}
+
+static bool iequals(const char *a, std::size_t a_len, const char *b)
+{
+    std::size_t b_len = std::strlen(b);
+    if (a_len != b_len)
+        return false;
+    for (std::size_t i = 0; i < a_len; ++i)
+    {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != b[i])
+            return false;
+    }
+    return true;
+}
+
+static bool is_resp_word(std::string_view word, const char *lower)
+{
+    return iequals(word.data(), word.size(), lower);
+}
+
+// RESP commands that write. They run alone: everything pipelined before them must
+// answer first, and nothing after them starts until they do.
+static bool resp_is_write(std::string_view name)
+{
+    return is_resp_word(name, "set") || is_resp_word(name, "mset") || is_resp_word(name, "del") ||
+           is_resp_word(name, "expire") || is_resp_word(name, "incr") || is_resp_word(name, "decr") ||
+           is_resp_word(name, "incrby") || is_resp_word(name, "decrby");
+}
+
+// Parses a RESP length or integer argument: optional '-', then digits only.
+static bool parse_resp_length(std::string_view text, long long &out)
+{
+    bool negative = !text.empty() && text[0] == '-';
+    if (negative)
+        text.remove_prefix(1);
+    if (text.empty() || text.size() > 18)
+        return false;
+    long long value = 0;
+    for (char c : text)
+    {
+        if (c < '0' || c > '9')
+            return false;
+        value = value * 10 + (c - '0');
+    }
+    out = negative ? -value : value;
+    return true;
+}
+
+static void append_resp_bulk(std::string &out, const std::string &value)
+{
+    out += '$';
+    out += std::to_string(value.size());
+    out += "\r\n";
+    out += value;
+    out += "\r\n";
+}
+
+// A base-10 64-bit integer: optional '-', then digits, nothing else.
+static bool parse_int64(std::string_view text, std::int64_t &out)
+{
+    auto result = std::from_chars(text.data(), text.data() + text.size(), out);
+    return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+// Finds `name` in a query string and percent-decodes its value.
+static bool query_param(std::string_view query, std::string_view name, std::string &value)
+{
+    std::size_t start = 0;
+    while (start <= query.size())
+    {
+        std::size_t amp = std::min(query.find('&', start), query.size());
+        const std::string_view pair = query.substr(start, amp - start);
+        const std::size_t eq = pair.find('=');
+        if (pair.substr(0, eq) == name)
+        {
+            value = eq == std::string_view::npos ? std::string()
+                                                 : httplib::decode_query_component(std::string(pair.substr(eq + 1)));
+            return true;
+        }
+        start = amp + 1;
+    }
+    return false;
+}
+
+static std::string_view unparsed(const std::string &in, std::size_t start)
+{
+    return std::string_view(in).substr(start);
+}
+
+// Fans one command out into several KVService calls and runs `done` once, on
+// whichever thread finishes the last call, with every status and value in call order.
+struct Gather : std::enable_shared_from_this<Gather>
+{
+    std::vector<KVService::Status> statuses;
+    std::vector<std::string> values;
+    std::vector<std::uint64_t> versions;
+    std::atomic<std::size_t> pending{0};
+    std::function<void(Gather &)> done;
+
+    static std::shared_ptr<Gather> start(std::size_t calls, std::function<void(Gather &)> done)
+    {
+        auto gather = std::make_shared<Gather>();
+        gather->statuses.resize(calls, KVService::Status::Ok);
+        gather->values.resize(calls);
+        gather->versions.resize(calls);
+        gather->pending = calls;
+        gather->done = std::move(done);
+        return gather;
+    }
+
+    KVService::Callback slot(std::size_t i)
+    {
+        return [self = shared_from_this(), i](KVService::Status status, VersionedValue entry)
+        {
+            self->statuses[i] = status;
+            self->values[i] = std::move(entry.value);
+            self->versions[i] = entry.version;
+            if (self->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                self->done(*self);
+        };
+    }
+
+    // Busy or Error if any call ran into one, otherwise Ok.
+    KVService::Status status() const
+    {
+        KVService::Status worst = KVService::Status::Ok;
+        for (KVService::Status s : statuses)
+        {
+            if (s == KVService::Status::Busy)
+                return s;
+            if (s == KVService::Status::Error)
+                worst = s;
+        }
+        return worst;
+    }
+
+    std::size_t count(KVService::Status wanted) const
+    {
+        return static_cast<std::size_t>(std::count(statuses.begin(), statuses.end(), wanted));
+    }
+};
+
+EventServer::EventServer(KVService &service, std::size_t loops, Io io, Protocol protocol)
+    : service_(service), io_(io), protocol_(protocol)
+{
+    const std::size_t count = loops ? loops : 1;
+    for (std::size_t i = 0; i < count; ++i)
+        loops_.push_back(std::make_unique<Loop>());
+}
+
+EventServer::~EventServer()
+{
+    stop();
+    for (auto &loop : loops_)
+    {
+        if (loop->thread.joinable())
+            loop->thread.join();
+        for (auto &entry : loop->conns)
+        {
+            if (!entry.second->closed)
+                close(entry.second->fd);
+        }
+        if (loop->wake_fd >= 0)
+            close(loop->wake_fd);
+        if (loop->epoll_fd >= 0)
+            close(loop->epoll_fd);
+    }
+    if (listen_fd_ >= 0)
+        close(listen_fd_);
+    if (!unix_path_.empty())
+        unlink(unix_path_.c_str());
+}
+
+bool EventServer::listen(const std::string &host, int port)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+    {
+        std::cerr << "EventServer: cannot resolve " << host << "\n";
+        return false;
+    }
+    for (addrinfo *ai = result; ai && listen_fd_ < 0; ai = ai->ai_next)
+    {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, SOMAXCONN) == 0)
+            listen_fd_ = fd;
+        else
+            close(fd);
+    }
+    freeaddrinfo(result);
+    if (listen_fd_ < 0)
+    {
+        std::cerr << "EventServer: cannot listen on " << host << ":" << port << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    return serve();
+}
+
+bool EventServer::listen_unix(const std::string &path)
+{
+    sockaddr_un addr{};
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "EventServer: bad unix socket path " << path << "\n";
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    // A socket file left by an earlier run would make bind fail.
+    unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(fd, SOMAXCONN) != 0)
+    {
+        std::cerr << "EventServer: cannot listen on " << path << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    listen_fd_ = fd;
+    unix_path_ = path;
+    return serve();
+}
+
+bool EventServer::serve()
+{
+    if (io_ == Io::Uring && !setup_rings())
+    {
+        std::cerr << "EventServer: io_uring unavailable, falling back to epoll\n";
+        for (auto &loop : loops_)
+            loop->ring.reset();
+    }
+
+    for (auto &loop : loops_)
+    {
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->wake_fd < 0)
+        {
+            std::cerr << "EventServer: failed to create eventfd\n";
+            return false;
+        }
+        if (loop->ring)
+            continue;
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0)
+        {
+            std::cerr << "EventServer: failed to create epoll instance\n";
+            return false;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = kWakeId;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+        // EPOLLEXCLUSIVE wakes one loop per incoming connection instead of all of them.
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.u64 = kListenId;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd_, &ev);
+    }
+
+    for (std::size_t i = 1; i < loops_.size(); ++i)
+    {
+        Loop *loop = loops_[i].get();
+        loop->thread = std::thread([this, loop]
+                                   { run(*loop); });
+    }
+    run(*loops_[0]);
+    return true;
+}
+
+void EventServer::stop()
+{
+    stopping_ = true;
+    for (auto &loop : loops_)
+    {
+        if (loop->wake_fd >= 0)
+        {
+            std::uint64_t one = 1;
+            ssize_t ignored = write(loop->wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+}
+
+void EventServer::run(Loop &loop)
+{
+    if (loop.ring)
+    {
+        run_uring(loop);
+        return;
+    }
+
+    tls_loop = &loop;
+    epoll_event events[256];
+    while (!stopping_)
+    {
+        int n = epoll_wait(loop.epoll_fd, events, 256, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "EventServer: epoll_wait failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            const std::uint64_t id = events[i].data.u64;
+            if (id == kListenId)
+            {
+                accept_all(loop);
+                continue;
+            }
+            if (id == kWakeId)
+            {
+                std::uint64_t count;
+                ssize_t ignored = read(loop.wake_fd, &count, sizeof(count));
+                (void)ignored;
+                drain_completions(loop);
+                continue;
+            }
+
+            auto it = loop.conns.find(id);
+            if (it == loop.conns.end())
+                continue;
+            Connection &conn = *it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close_connection(loop, conn);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !flush(loop, conn))
+                continue;
+            if (events[i].events & EPOLLIN)
+                on_readable(loop, conn);
+        }
+    }
+    tls_loop = nullptr;
+}
+
+void EventServer::accept_all(Loop &loop)
+{
+    for (;;)
+    {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // EAGAIN: another loop took it, or the backlog is empty.
+            return;
+        }
+        if (unix_path_.empty())
+        {
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+
+        auto conn = std::make_unique<Connection>();
+        conn->fd = fd;
+        conn->id = loop.next_id++;
+        conn->events = EPOLLIN;
+        epoll_event ev{};
+        ev.events = conn->events;
+        ev.data.u64 = conn->id;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        loop.conns.emplace(conn->id, std::move(conn));
+    }
+}
+
+void EventServer::on_readable(Loop &loop, Connection &conn)
+{
+    char buf[kReadChunk];
+    while (conn.in.size() < kMaxBufferedInput)
+    {
+        ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            conn.in.append(buf, static_cast<std::size_t>(n));
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        // Peer closed or reset; nothing more can be delivered.
+        close_connection(loop, conn);
+        return;
+    }
+    process_input(loop, conn);
+    flush(loop, conn);
+}
+
+void EventServer::process_input(Loop &loop, Connection &conn)
+{
+    while (!conn.closing && !conn.last && !conn.exclusive && conn.pipeline.size() < kMaxPipeline)
+    {
+        bool parsed;
+        switch (protocol_)
+        {
+        case Protocol::Memcached:
+            parsed = next_memcached(loop, conn);
+            break;
+        case Protocol::Resp:
+            parsed = next_resp(loop, conn);
+            break;
+        default:
+            parsed = next_http(loop, conn);
+            break;
+        }
+        if (!parsed)
+            break;
+    }
+    // Parsers advance in_start rather than erasing per command; compact once per batch.
+    if (conn.in_start)
+    {
+        conn.in.erase(0, conn.in_start);
+        conn.in_start = 0;
+    }
+}
+
+// Parses one HTTP request off the unparsed input and dispatches it. Returns false
+// when more input is needed or the connection is being closed.
+bool EventServer::next_http(Loop &loop, Connection &conn)
+{
+    const std::string_view in = unparsed(conn.in, conn.in_start);
+    const std::size_t header_end = in.find("\r\n\r\n");
+    if (header_end == std::string_view::npos)
+    {
+        if (in.size() > kMaxHeaderBytes)
+            answer(conn, http_response(431, "text/plain", "Request headers too large", false), false);
+        return false;
+    }
+    if (header_end > kMaxHeaderBytes)
+    {
+        answer(conn, http_response(431, "text/plain", "Request headers too large", false), false);
+        return false;
+    }
+
+    // Request line: METHOD SP target SP HTTP/x.y
+    const std::size_t line_end = in.find("\r\n");
+    const std::size_t sp1 = in.find(' ');
+    const std::size_t sp2 = sp1 == std::string_view::npos ? std::string_view::npos : in.find(' ', sp1 + 1);
+    if (sp1 == std::string_view::npos || sp2 == std::string_view::npos || sp2 > line_end)
+    {
+        answer(conn, http_response(400, "text/plain", "Bad request", false), false);
+        return false;
+    }
+    const std::string_view method = in.substr(0, sp1);
+    // Requests that change data run alone, like RESP writes: a pipelined GET before a
+    // PUT must not see the new value, nor one after it the old.
+    if (method != "GET" && !conn.pipeline.empty())
+        return false;
+    bool keep_alive = in.compare(sp2 + 1, line_end - sp2 - 1, "HTTP/1.1") == 0;
+
+    std::size_t content_length = 0;
+    RequestHeaders headers;
+    bool expect_continue = false;
+    bool chunked = false;
+    std::size_t pos = line_end + 2;
+    while (pos < header_end)
+    {
+        std::size_t eol = in.find("\r\n", pos);
+        std::size_t colon = in.find(':', pos);
+        if (colon != std::string_view::npos && colon < eol)
+        {
+            std::size_t vstart = colon + 1;
+            while (vstart < eol && (in[vstart] == ' ' || in[vstart] == '\t'))
+                ++vstart;
+            const char *name = in.data() + pos;
+            const std::size_t name_len = colon - pos;
+            const std::string_view value = in.substr(vstart, eol - vstart);
+            if (iequals(name, name_len, "content-length"))
+            {
+                content_length = std::strtoull(std::string(value).c_str(), nullptr, 10);
+            }
+            else if (iequals(name, name_len, "connection"))
+            {
+                if (iequals(value.data(), value.size(), "close"))
+                    keep_alive = false;
+                else if (iequals(value.data(), value.size(), "keep-alive"))
+                    keep_alive = true;
+            }
+            else if (iequals(name, name_len, "transfer-encoding"))
+            {
+                chunked = true;
+            }
+            else if (iequals(name, name_len, "expect"))
+            {
+                expect_continue = iequals(value.data(), value.size(), "100-continue");
+            }
+            else if (iequals(name, name_len, "if-none-match"))
+            {
+                headers.if_none_match = std::string(value);
+            }
+            else if (iequals(name, name_len, "if-match"))
+            {
+                headers.if_match = std::string(value);
+            }
+            else if (iequals(name, name_len, "accept-encoding"))
+            {
+                headers.accept_gzip = gzip::accepted(value);
+            }
+        }
+        pos = eol + 2;
+    }
+
+    if (chunked)
+    {
+        answer(conn, http_response(501, "text/plain", "Chunked request bodies are not supported", false), false);
+        return false;
+    }
+    if (content_length > kMaxBodyBytes)
+    {
+        answer(conn, http_response(413, "text/plain", "Request body too large", false), false);
+        return false;
+    }
+
+    const std::size_t total = header_end + 4 + content_length;
+    if (in.size() < total)
+    {
+        // Only a lone request waits for its body here, so "100 Continue" cannot
+        // overtake the response to an earlier one.
+        if (expect_continue && !conn.sent_continue && conn.pipeline.empty())
+        {
+            queue_output(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+            conn.sent_continue = true;
+        }
+        return false;
+    }
+
+    std::string body(in.substr(header_end + 4, content_length));
+    const std::string target(in.substr(sp1 + 1, sp2 - sp1 - 1));
+    const std::string method_name(method);
+    conn.in_start += total;
+    conn.sent_continue = false;
+    conn.keep_alive = keep_alive;
+    conn.last = !keep_alive;
+    dispatch(loop, conn, method_name, target, std::move(body), headers, method != "GET");
+    return true;
+}
+
+void EventServer::dispatch(Loop &loop, Connection &conn, const std::string &method, const std::string &target,
+                           std::string body, const RequestHeaders &headers, bool exclusive)
+{
+    const bool keep_alive = conn.keep_alive;
+    Loop *owner = &loop;
+    const std::uint64_t id = conn.id;
+    const std::uint64_t seq = open_slot(conn, exclusive);
+    auto reply = [this, owner, id, seq, keep_alive](int status, const char *content_type, const std::string &text)
+    {
+        // Shed by the slow lane: tell the client when to retry.
+        const char *extra = status == 503 ? "Retry-After: 1\r\n" : "";
+        complete(owner, id, seq, http_response(status, content_type, text, keep_alive, extra));
+    };
+
+    const std::size_t query_start = target.find('?');
+    const std::string path = target.substr(0, query_start);
+
+    // POST /kv/<key>/incr?by=<n>
+    constexpr std::string_view incr_suffix = "/incr";
+    if (method == "POST" && path.size() > 4 + incr_suffix.size() && path.compare(0, 4, "/kv/") == 0 &&
+        path.compare(path.size() - incr_suffix.size(), incr_suffix.size(), incr_suffix) == 0)
+    {
+        const std::string decoded = httplib::decode_path_component(path.substr(0, path.size() - incr_suffix.size()));
+        std::string_view key_view;
+        if (!kv_route::match_key(decoded, key_view))
+        {
+            reply(404, "text/plain", "Not found");
+            return;
+        }
+        std::int64_t delta = 1;
+        if (query_start != std::string::npos)
+        {
+            std::string by;
+            if (query_param(std::string_view(target).substr(query_start + 1), "by", by) &&
+                !parse_int64(by, delta))
+            {
+                reply(400, "text/plain", "Bad request: invalid by");
+                return;
+            }
+        }
+        service_.increment(std::string(key_view), delta, [this, owner, id, seq, keep_alive, reply](KVService::Status status, VersionedValue entry)
+                           {
+            if (status == KVService::Status::Ok)
+                complete(owner, id, seq, http_response(200, "text/plain", entry.value, keep_alive,
+                                                       ("ETag: " + etag::format(entry.version) + "\r\n").c_str()));
+            else if (status == KVService::Status::Invalid)
+                reply(409, "text/plain", "Value is not an integer or would overflow");
+            else if (status == KVService::Status::Busy)
+                reply(503, "text/plain", "Server busy");
+            else
+                reply(500, "text/plain", "DB error"); });
+        return;
+    }
+
+    // GET, PUT and DELETE /kv/<key>
+    if (path.compare(0, 4, "/kv/") == 0 && (method == "GET" || method == "PUT" || method == "DELETE"))
+    {
+        const std::string decoded = httplib::decode_path_component(path);
+        std::string_view key_view;
+        if (!kv_route::match_key(decoded, key_view))
+        {
+            reply(404, "text/plain", "Not found");
+            return;
+        }
+        const std::string key(key_view);
+        if (method == "GET")
+        {
+            const bool accept_gzip = headers.accept_gzip;
+            service_.get(key, [this, owner, id, seq, keep_alive, if_none_match = headers.if_none_match, accept_gzip, reply](KVService::Status status, VersionedValue entry)
+                         {
+                if (status == KVService::Status::Ok) {
+                    // A client that already holds this version gets no body back.
+                    const bool send_gzip = entry.gzipped && accept_gzip;
+                    std::string extra = "ETag: " + etag::format(entry.version, send_gzip) + "\r\n";
+                    if (entry.gzipped)
+                        extra += "Vary: Accept-Encoding\r\n";
+                    if (etag::none_match_hits(if_none_match, entry.version))
+                        complete(owner, id, seq, not_modified_response(extra, keep_alive));
+                    else if (send_gzip)
+                        complete(owner, id, seq, http_response(200, kValueContentType, *entry.gzipped, keep_alive,
+                                                               (extra + "Content-Encoding: gzip\r\n").c_str()));
+                    else
+                        complete(owner, id, seq, http_response(200, kValueContentType, entry.value, keep_alive,
+                                                               extra.c_str()));
+                } else if (status == KVService::Status::NotFound)
+                    reply(404, "text/plain", "Not found");
+                else if (status == KVService::Status::Busy)
+                    reply(503, "text/plain", "Server busy");
+                else
+                    reply(500, "text/plain", "DB error"); }, accept_gzip);
+        }
+        else if (method == "PUT")
+        {
+            // The raw body is the value, moved through to the cache.
+            auto stored = [this, owner, id, seq, keep_alive, reply](KVService::Status status, VersionedValue entry)
+            {
+                if (status == KVService::Status::Ok)
+                    complete(owner, id, seq, http_response(201, "text/plain", "OK", keep_alive,
+                                                           ("ETag: " + etag::format(entry.version) + "\r\n").c_str()));
+                else if (status == KVService::Status::NotFound || status == KVService::Status::Conflict)
+                    reply(412, "text/plain", "Precondition failed");
+                else if (status == KVService::Status::Busy)
+                    reply(503, "text/plain", "Server busy");
+                else
+                    reply(500, "text/plain", "DB error");
+            };
+            std::optional<std::uint64_t> expected;
+            if (!headers.if_match.has_value())
+                service_.put(key, std::move(body), std::move(stored));
+            else if (etag::parse_if_match(*headers.if_match, expected))
+                service_.compare_and_set(key, std::move(body), expected, std::move(stored));
+            else
+                stored(KVService::Status::Conflict, {});
+        }
+        else
+        {
+            service_.remove(key, [reply](KVService::Status status, VersionedValue)
+                            {
+                if (status == KVService::Status::Ok || status == KVService::Status::NotFound)
+                    reply(200, "text/plain", "Deleted");
+                else if (status == KVService::Status::Busy)
+                    reply(503, "text/plain", "Server busy");
+                else
+                    reply(500, "text/plain", "Delete failed"); });
+        }
+        return;
+    }
+
+    // POST /kv with a form-encoded key and value
+    if (path == "/kv" && method == "POST")
+    {
+        std::string key;
+        std::string value;
+        bool has_key = false;
+        bool has_value = false;
+        std::size_t start = 0;
+        while (start <= body.size())
+        {
+            std::size_t amp = body.find('&', start);
+            if (amp == std::string::npos)
+                amp = body.size();
+            std::size_t eq = body.find('=', start);
+            if (eq != std::string::npos && eq < amp)
+            {
+                std::string name = httplib::decode_query_component(body.substr(start, eq - start));
+                if (name == "key" && !has_key)
+                {
+                    key = httplib::decode_query_component(body.substr(eq + 1, amp - eq - 1));
+                    has_key = true;
+                }
+                else if (name == "value" && !has_value)
+                {
+                    value = httplib::decode_query_component(body.substr(eq + 1, amp - eq - 1));
+                    has_value = true;
+                }
+            }
+            start = amp + 1;
+        }
+        if (!has_key || !has_value)
+        {
+            reply(400, "text/plain", "Bad request: missing key/value");
+            return;
+        }
+        service_.put(key, value, [reply](KVService::Status status, VersionedValue)
+                     {
+            if (status == KVService::Status::Ok)
+                reply(201, "text/plain", "OK");
+            else if (status == KVService::Status::Busy)
+                reply(503, "text/plain", "Server busy");
+            else
+                reply(500, "text/plain", "DB error"); });
+        return;
+    }
+
+    reply(404, "text/plain", "Not found");
+}
+
+// Parses one memcached text-protocol command off the unparsed input and runs it.
+// Returns false when more input is needed or the connection is being closed.
+bool EventServer::next_memcached(Loop &loop, Connection &conn)
+{
+    const std::string_view in = unparsed(conn.in, conn.in_start);
+    const std::size_t line_end = in.find("\r\n");
+    if (line_end == std::string_view::npos)
+    {
+        if (in.size() > kMaxCommandBytes)
+            answer(conn, "CLIENT_ERROR line too long\r\n", false);
+        return false;
+    }
+
+    std::vector<std::string_view> tokens;
+    const std::string_view line = in.substr(0, line_end);
+    std::size_t pos = 0;
+    while (pos < line.size())
+    {
+        const std::size_t end = std::min(line.find(' ', pos), line.size());
+        if (end > pos)
+            tokens.push_back(line.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    const std::size_t consumed = line_end + 2;
+    const std::string_view command = tokens.empty() ? std::string_view() : tokens[0];
+
+    // Data lost framing (bad length or terminator): answer and drop the connection.
+    auto fail = [&](const char *error)
+    {
+        answer(conn, error, false);
+        return false;
+    };
+    // The command is well formed but cannot run; the connection carries on.
+    auto reject = [&](const char *error)
+    {
+        conn.in_start += consumed;
+        answer(conn, error);
+        return true;
+    };
+
+    if (command == "get" || command == "gets")
+    {
+        if (tokens.size() < 2)
+            return reject("ERROR\r\n");
+        std::vector<std::string> keys;
+        keys.reserve(tokens.size() - 1);
+        for (std::size_t i = 1; i < tokens.size(); ++i)
+        {
+            if (!valid_memcached_key(tokens[i]))
+                return reject("CLIENT_ERROR bad key\r\n");
+            keys.emplace_back(tokens[i]);
+        }
+        conn.in_start += consumed;
+        memcached_get(loop, conn, std::move(keys), command == "gets");
+        return true;
+    }
+
+    if (command == "set" || command == "cas")
+    {
+        // set <key> <flags> <exptime> <bytes> [noreply]
+        // cas <key> <flags> <exptime> <bytes> <cas unique> [noreply]
+        const bool cas = command == "cas";
+        const std::size_t fields = cas ? 6 : 5;
+        if (tokens.size() != fields && tokens.size() != fields + 1)
+            return reject("ERROR\r\n");
+        // Writes wait for earlier commands so reads pipelined before them see the old value.
+        if (!conn.pipeline.empty())
+            return false;
+        char *end = nullptr;
+        const std::string length_token(tokens[4]);
+        const unsigned long long bytes = std::strtoull(length_token.c_str(), &end, 10);
+        if (end == length_token.c_str() || *end != '\0')
+            return fail("CLIENT_ERROR bad command line format\r\n");
+        if (bytes > kMaxBodyBytes)
+            return fail("SERVER_ERROR object too large for cache\r\n");
+        std::uint64_t unique = 0;
+        if (cas)
+        {
+            const std::string unique_token(tokens[5]);
+            unique = std::strtoull(unique_token.c_str(), &end, 10);
+            if (end == unique_token.c_str() || *end != '\0')
+                return fail("CLIENT_ERROR bad command line format\r\n");
+        }
+        const std::size_t total = consumed + bytes + 2;
+        if (in.size() < total)
+            return false;
+        // A refused set swallows its data block too, as memcached does; left in the
+        // input, it would be parsed as commands of its own.
+        auto swallow = [&](const char *error)
+        {
+            conn.in_start += total;
+            answer(conn, error);
+            return true;
+        };
+        if (!valid_memcached_key(tokens[1]))
+            return swallow("CLIENT_ERROR bad key\r\n");
+        std::uint32_t flags = 0;
+        long long exptime = 0;
+        auto flags_parsed = std::from_chars(tokens[2].data(), tokens[2].data() + tokens[2].size(), flags);
+        auto exptime_parsed = std::from_chars(tokens[3].data(), tokens[3].data() + tokens[3].size(), exptime);
+        if (flags_parsed.ec != std::errc() || flags_parsed.ptr != tokens[2].data() + tokens[2].size() ||
+            exptime_parsed.ec != std::errc() || exptime_parsed.ptr != tokens[3].data() + tokens[3].size())
+            return swallow("CLIENT_ERROR bad command line format\r\n");
+        // Flags are not stored. Clients mark serialized or compressed values with
+        // them, so a value set with flags that would come back as 0 is refused.
+        if (flags != 0)
+            return swallow("CLIENT_ERROR nonzero flags are not supported\r\n");
+        if (in.compare(consumed + bytes, 2, "\r\n") != 0)
+            return fail("CLIENT_ERROR bad data chunk\r\n");
+        std::optional<std::chrono::milliseconds> ttl;
+        if (exptime != 0)
+            ttl = memcached_ttl(exptime);
+
+        const bool noreply = tokens.size() == fields + 1 && tokens[fields] == "noreply";
+        std::string key(tokens[1]);
+        std::string value(in.substr(consumed, bytes));
+        conn.in_start += total;
+        Loop *owner = &loop;
+        const std::uint64_t id = conn.id;
+        const std::uint64_t seq = open_slot(conn, true);
+        auto stored = [this, owner, id, seq, noreply, key, ttl](KVService::Status status, VersionedValue)
+        {
+            // The write cleared any earlier deadline; this one replaces it.
+            if (status == KVService::Status::Ok && ttl)
+                service_.set_ttl(key, *ttl);
+            const char *text = status == KVService::Status::Ok         ? "STORED\r\n"
+                               : status == KVService::Status::Conflict ? "EXISTS\r\n"
+                               : status == KVService::Status::NotFound ? "NOT_FOUND\r\n"
+                               : status == KVService::Status::Busy     ? "SERVER_ERROR busy\r\n"
+                                                                       : "SERVER_ERROR db error\r\n";
+            complete(owner, id, seq, noreply ? std::string() : text);
+        };
+        // The CAS unique is the version gets reported.
+        if (cas)
+            service_.compare_and_set(key, std::move(value), unique, std::move(stored));
+        else
+            service_.put(key, std::move(value), std::move(stored));
+        return true;
+    }
+
+    if (command == "delete")
+    {
+        // delete <key> [noreply]
+        if (tokens.size() != 2 && tokens.size() != 3)
+            return reject("ERROR\r\n");
+        if (!conn.pipeline.empty())
+            return false;
+        if (!valid_memcached_key(tokens[1]))
+            return reject("CLIENT_ERROR bad key\r\n");
+        const bool noreply = tokens.size() == 3 && tokens[2] == "noreply";
+        std::string key(tokens[1]);
+        conn.in_start += consumed;
+        Loop *owner = &loop;
+        const std::uint64_t id = conn.id;
+        const std::uint64_t seq = open_slot(conn, true);
+        service_.remove(key, [this, owner, id, seq, noreply](KVService::Status status, VersionedValue)
+                        {
+            const char *text = status == KVService::Status::Ok         ? "DELETED\r\n"
+                               : status == KVService::Status::NotFound ? "NOT_FOUND\r\n"
+                               : status == KVService::Status::Busy     ? "SERVER_ERROR busy\r\n"
+                                                                       : "SERVER_ERROR db error\r\n";
+            complete(owner, id, seq, noreply ? std::string() : text); });
+        return true;
+    }
+
+    if (command == "version")
+        return reject("VERSION kv_server\r\n");
+    if (command == "quit")
+        return fail("");
+    return reject("ERROR\r\n");
+}
+
+void EventServer::memcached_get(Loop &loop, Connection &conn, std::vector<std::string> keys, bool with_cas)
+{
+    Loop *owner = &loop;
+    const std::uint64_t id = conn.id;
+    const std::uint64_t seq = open_slot(conn);
+    auto gather = Gather::start(keys.size(), [this, owner, id, seq, keys, with_cas](Gather &g)
+                                {
+        const KVService::Status status = g.status();
+        if (status == KVService::Status::Busy || status == KVService::Status::Error) {
+            complete(owner, id, seq, status == KVService::Status::Busy ? "SERVER_ERROR busy\r\n" : "SERVER_ERROR db error\r\n");
+            return;
+        }
+        std::string out;
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            if (g.statuses[i] != KVService::Status::Ok)
+                continue;
+            // Only flags 0 are accepted, so every value comes back with them.
+            out += "VALUE ";
+            out += keys[i];
+            out += " 0 ";
+            out += std::to_string(g.values[i].size());
+            if (with_cas) {
+                out += ' ';
+                out += std::to_string(g.versions[i]);
+            }
+            out += "\r\n";
+            out += g.values[i];
+            out += "\r\n";
+        }
+        out += "END\r\n";
+        complete(owner, id, seq, std::move(out)); });
+    for (std::size_t i = 0; i < keys.size(); ++i)
+        service_.get(keys[i], gather->slot(i));
+}
+
+// Parses one RESP2 command (a multibulk array, or an inline command line) off the
+// unparsed input and runs it. Returns false when more input is needed or the
+// connection is being closed.
+bool EventServer::next_resp(Loop &loop, Connection &conn)
+{
+    const std::string_view in = unparsed(conn.in, conn.in_start);
+    if (in.empty())
+        return false;
+
+    std::vector<std::string_view> args;
+    std::size_t consumed = 0;
+    if (in[0] == '*')
+    {
+        std::size_t line_end = in.find("\r\n");
+        if (line_end == std::string_view::npos)
+        {
+            if (in.size() > kMaxCommandBytes)
+                answer(conn, "-ERR Protocol error: too big multibulk count\r\n", false);
+            return false;
+        }
+        long long count = 0;
+        if (!parse_resp_length(in.substr(1, line_end - 1), count) || count > static_cast<long long>(kMaxRespArgs))
+        {
+            answer(conn, "-ERR Protocol error: invalid multibulk length\r\n", false);
+            return false;
+        }
+        std::size_t pos = line_end + 2;
+        args.reserve(static_cast<std::size_t>(std::max(0LL, count)));
+        for (long long i = 0; i < count; ++i)
+        {
+            if (pos >= in.size())
+                return false;
+            if (in[pos] != '$')
+            {
+                answer(conn, "-ERR Protocol error: expected '$'\r\n", false);
+                return false;
+            }
+            line_end = in.find("\r\n", pos);
+            if (line_end == std::string_view::npos)
+            {
+                if (in.size() - pos > kMaxCommandBytes)
+                    answer(conn, "-ERR Protocol error: invalid bulk length\r\n", false);
+                return false;
+            }
+            long long len = 0;
+            if (!parse_resp_length(in.substr(pos + 1, line_end - pos - 1), len) || len < 0 ||
+                static_cast<unsigned long long>(len) > kMaxBodyBytes)
+            {
+                answer(conn, "-ERR Protocol error: invalid bulk length\r\n", false);
+                return false;
+            }
+            const std::size_t data = line_end + 2;
+            const std::size_t bytes = static_cast<std::size_t>(len);
+            if (in.size() < data + bytes + 2)
+                return false;
+            if (in.compare(data + bytes, 2, "\r\n") != 0)
+            {
+                answer(conn, "-ERR Protocol error: bad bulk terminator\r\n", false);
+                return false;
+            }
+            args.push_back(in.substr(data, bytes));
+            pos = data + bytes + 2;
+        }
+        consumed = pos;
+    }
+    else
+    {
+        // Inline command, as typed into telnet: space-separated words on one line.
+        const std::size_t line_end = in.find('\n');
+        if (line_end == std::string_view::npos)
+        {
+            if (in.size() > kMaxCommandBytes)
+                answer(conn, "-ERR Protocol error: too big inline request\r\n", false);
+            return false;
+        }
+        std::string_view line = in.substr(0, line_end);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        std::size_t pos = 0;
+        while (pos < line.size())
+        {
+            const std::size_t end = std::min(line.find(' ', pos), line.size());
+            if (end > pos)
+                args.push_back(line.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        consumed = line_end + 1;
+    }
+
+    if (args.empty())
+    {
+        conn.in_start += consumed;
+        return true;
+    }
+    if (resp_is_write(args[0]) && !conn.pipeline.empty())
+        return false; // runs once everything pipelined before it has answered
+    std::vector<std::string> command(args.begin(), args.end());
+    conn.in_start += consumed;
+    resp_dispatch(loop, conn, std::move(command));
+    return true;
+}
+
+void EventServer::resp_dispatch(Loop &loop, Connection &conn, std::vector<std::string> args)
+{
+    const std::string &name = args[0];
+    auto is = [&name](const char *command)
+    { return iequals(name.data(), name.size(), command); };
+    auto arity_error = [&]
+    { answer(conn, "-ERR wrong number of arguments for '" + name + "' command\r\n"); };
+
+    Loop *owner = &loop;
+    const std::uint64_t id = conn.id;
+    auto error_reply = [](KVService::Status status)
+    {
+        return status == KVService::Status::Busy ? "-ERR server busy, retry later\r\n" : "-ERR db error\r\n";
+    };
+
+    if (is("get"))
+    {
+        if (args.size() != 2)
+            return arity_error();
+        const std::uint64_t seq = open_slot(conn);
+        service_.get(args[1], [this, owner, id, seq, error_reply](KVService::Status status, VersionedValue entry)
+                     {
+            if (status == KVService::Status::Ok) {
+                std::string out;
+                append_resp_bulk(out, entry.value);
+                complete(owner, id, seq, std::move(out));
+            } else if (status == KVService::Status::NotFound) {
+                complete(owner, id, seq, "$-1\r\n");
+            } else {
+                complete(owner, id, seq, error_reply(status));
+            } });
+        return;
+    }
+
+    if (is("mget") || is("exists"))
+    {
+        if (args.size() < 2)
+            return arity_error();
+        const bool exists = is("exists");
+        const std::uint64_t seq = open_slot(conn);
+        auto gather = Gather::start(args.size() - 1, [this, owner, id, seq, exists, error_reply](Gather &g)
+                                    {
+            const KVService::Status status = g.status();
+            if (status == KVService::Status::Busy || status == KVService::Status::Error) {
+                complete(owner, id, seq, error_reply(status));
+                return;
+            }
+            if (exists) {
+                complete(owner, id, seq, ":" + std::to_string(g.count(KVService::Status::Ok)) + "\r\n");
+                return;
+            }
+            std::string out = "*" + std::to_string(g.values.size()) + "\r\n";
+            for (std::size_t i = 0; i < g.values.size(); ++i) {
+                if (g.statuses[i] == KVService::Status::Ok)
+                    append_resp_bulk(out, g.values[i]);
+                else
+                    out += "$-1\r\n";
+            }
+            complete(owner, id, seq, std::move(out)); });
+        for (std::size_t i = 1; i < args.size(); ++i)
+            service_.get(args[i], gather->slot(i - 1));
+        return;
+    }
+
+    if (is("set"))
+    {
+        // SET key value [EX seconds | PX milliseconds]
+        if (args.size() < 3)
+            return arity_error();
+        std::optional<std::chrono::milliseconds> ttl;
+        if (args.size() == 5 && (is_resp_word(args[3], "ex") || is_resp_word(args[3], "px")))
+        {
+            long long amount = 0;
+            // Rejected before converting to milliseconds, which could overflow.
+            const bool ex = is_resp_word(args[3], "ex");
+            if (!parse_resp_length(args[4], amount) || amount <= 0 || (ex && amount > LLONG_MAX / 1000))
+                return answer(conn, "-ERR invalid expire time in 'set' command\r\n");
+            ttl = ex ? std::chrono::milliseconds(amount * 1000) : std::chrono::milliseconds(amount);
+        }
+        else if (args.size() != 3)
+        {
+            return answer(conn, "-ERR syntax error\r\n");
+        }
+        const std::uint64_t seq = open_slot(conn, true);
+        std::string key = args[1];
+        service_.put(key, std::move(args[2]), [this, owner, id, seq, key, ttl, error_reply](KVService::Status status, VersionedValue)
+                     {
+            if (status != KVService::Status::Ok) {
+                complete(owner, id, seq, error_reply(status));
+                return;
+            }
+            if (ttl)
+                service_.set_ttl(key, *ttl);
+            complete(owner, id, seq, "+OK\r\n"); });
+        return;
+    }
+
+    if (is("mset"))
+    {
+        // Each pair is written independently; MSET is not atomic here.
+        if (args.size() < 3 || args.size() % 2 == 0)
+            return arity_error();
+        const std::uint64_t seq = open_slot(conn, true);
+        auto gather = Gather::start(args.size() / 2, [this, owner, id, seq, error_reply](Gather &g)
+                                    {
+            const KVService::Status status = g.status();
+            complete(owner, id, seq, status == KVService::Status::Ok ? "+OK\r\n" : error_reply(status)); });
+        for (std::size_t i = 1; i + 1 < args.size(); i += 2)
+            service_.put(args[i], std::move(args[i + 1]), gather->slot(i / 2));
+        return;
+    }
+
+    if (is("del"))
+    {
+        if (args.size() < 2)
+            return arity_error();
+        const std::uint64_t seq = open_slot(conn, true);
+        auto gather = Gather::start(args.size() - 1, [this, owner, id, seq, error_reply](Gather &g)
+                                    {
+            const KVService::Status status = g.status();
+            if (status == KVService::Status::Busy || status == KVService::Status::Error)
+                complete(owner, id, seq, error_reply(status));
+            else
+                complete(owner, id, seq, ":" + std::to_string(g.count(KVService::Status::Ok)) + "\r\n"); });
+        for (std::size_t i = 1; i < args.size(); ++i)
+            service_.remove(args[i], gather->slot(i - 1));
+        return;
+    }
+
+    if (is("expire"))
+    {
+        // EXPIRE key seconds: 1 if the key exists, 0 if not. A non-positive time deletes it.
+        if (args.size() != 3)
+            return arity_error();
+        long long seconds = 0;
+        if (!parse_resp_length(args[2], seconds))
+            return answer(conn, "-ERR value is not an integer or out of range\r\n");
+        if (seconds > LLONG_MAX / 1000)
+            return answer(conn, "-ERR invalid expire time in 'expire' command\r\n");
+        const std::uint64_t seq = open_slot(conn, true);
+        std::string key = args[1];
+        if (seconds <= 0)
+        {
+            service_.remove(key, [this, owner, id, seq, error_reply](KVService::Status status, VersionedValue)
+                            {
+                if (status == KVService::Status::Ok || status == KVService::Status::NotFound)
+                    complete(owner, id, seq, status == KVService::Status::Ok ? ":1\r\n" : ":0\r\n");
+                else
+                    complete(owner, id, seq, error_reply(status)); });
+            return;
+        }
+        service_.get(key, [this, owner, id, seq, key, seconds, error_reply](KVService::Status status, VersionedValue)
+                     {
+            if (status == KVService::Status::Ok)
+                complete(owner, id, seq, service_.set_ttl(key, std::chrono::seconds(seconds)) ? ":1\r\n" : ":0\r\n");
+            else if (status == KVService::Status::NotFound)
+                complete(owner, id, seq, ":0\r\n");
+            else
+                complete(owner, id, seq, error_reply(status)); });
+        return;
+    }
+
+    if (is("incr") || is("decr") || is("incrby") || is("decrby"))
+    {
+        // INCR key / DECR key / INCRBY key n / DECRBY key n: the new value.
+        const bool by = is("incrby") || is("decrby");
+        if (args.size() != (by ? 3u : 2u))
+            return arity_error();
+        std::int64_t delta = 1;
+        if (by && !parse_int64(args[2], delta))
+            return answer(conn, "-ERR value is not an integer or out of range\r\n");
+        if (is("decr") || is("decrby"))
+        {
+            if (delta == INT64_MIN)
+                return answer(conn, "-ERR decrement would overflow\r\n");
+            delta = -delta;
+        }
+        const std::uint64_t seq = open_slot(conn, true);
+        service_.increment(args[1], delta, [this, owner, id, seq, error_reply](KVService::Status status, VersionedValue entry)
+                           {
+            if (status == KVService::Status::Ok)
+                complete(owner, id, seq, ":" + entry.value + "\r\n");
+            else if (status == KVService::Status::Invalid)
+                complete(owner, id, seq, "-ERR value is not an integer or out of range\r\n");
+            else
+                complete(owner, id, seq, error_reply(status)); });
+        return;
+    }
+
+    if (is("ping"))
+    {
+        if (args.size() > 2)
+            return arity_error();
+        if (args.size() == 1)
+            return answer(conn, "+PONG\r\n");
+        std::string out;
+        append_resp_bulk(out, args[1]);
+        return answer(conn, std::move(out));
+    }
+    if (is("echo"))
+    {
+        if (args.size() != 2)
+            return arity_error();
+        std::string out;
+        append_resp_bulk(out, args[1]);
+        return answer(conn, std::move(out));
+    }
+    if (is("select"))
+        return answer(conn, args.size() == 2 && args[1] == "0" ? "+OK\r\n" : "-ERR DB index is out of range\r\n");
+    // Clients probe these on connect; an empty reply tells them there is nothing to learn.
+    if (is("command") || is("config"))
+        return answer(conn, "*0\r\n");
+    if (is("quit"))
+        return answer(conn, "+OK\r\n", false);
+    answer(conn, "-ERR unknown command '" + name + "'\r\n");
+}
+
+std::uint64_t EventServer::open_slot(Connection &conn, bool exclusive)
+{
+    conn.pipeline.emplace_back();
+    if (exclusive)
+        conn.exclusive = true;
+    return conn.first_seq + conn.pipeline.size() - 1;
+}
+
+void EventServer::answer(Connection &conn, std::string response, bool keep_alive)
+{
+    if (!keep_alive)
+        conn.last = true;
+    apply(conn, open_slot(conn), std::move(response));
+}
+
+void EventServer::queue_output(Connection &conn, std::string data)
+{
+    if (!data.empty())
+        conn.out.push_back(std::move(data));
+}
+
+void EventServer::complete(Loop *loop, std::uint64_t conn_id, std::uint64_t seq, std::string response)
+{
+    if (tls_loop == loop)
+    {
+        auto it = loop->conns.find(conn_id);
+        if (it != loop->conns.end())
+            apply(*it->second, seq, std::move(response));
+        return;
+    }
+
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(loop->completions_mutex);
+        was_empty = loop->completions.empty();
+        loop->completions.push_back(Completion{conn_id, seq, std::move(response)});
+    }
+    if (was_empty)
+    {
+        std::uint64_t one = 1;
+        ssize_t ignored = write(loop->wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void EventServer::apply(Connection &conn, std::uint64_t seq, std::string response)
+{
+    if (seq < conn.first_seq || seq - conn.first_seq >= conn.pipeline.size())
+        return;
+    conn.pipeline[seq - conn.first_seq] = std::move(response);
+    // Move every response whose predecessors are all written to `out`, in order.
+    while (!conn.pipeline.empty() && conn.pipeline.front())
+    {
+        queue_output(conn, std::move(*conn.pipeline.front()));
+        conn.pipeline.pop_front();
+        ++conn.first_seq;
+    }
+    if (conn.pipeline.empty())
+    {
+        conn.exclusive = false;
+        if (conn.last)
+            conn.closing = true;
+    }
+}
+
+void EventServer::drain_completions(Loop &loop)
+{
+    std::vector<Completion> batch;
+    {
+        std::lock_guard<std::mutex> lock(loop.completions_mutex);
+        batch.swap(loop.completions);
+    }
+    // Apply the whole batch first so each connection gets one parse and one write.
+    std::vector<Connection *> touched;
+    for (Completion &c : batch)
+    {
+        auto it = loop.conns.find(c.conn_id);
+        if (it == loop.conns.end() || it->second->closed)
+            continue; // closed while the request was in flight
+        Connection &conn = *it->second;
+        apply(conn, c.seq, std::move(c.response));
+        if (!conn.pending_flush)
+        {
+            conn.pending_flush = true;
+            touched.push_back(&conn);
+        }
+    }
+    for (Connection *conn : touched)
+    {
+        conn->pending_flush = false;
+        // Requests that arrived behind the completed ones can run now.
+        process_input(loop, *conn);
+        flush(loop, *conn);
+    }
+}
+
+bool EventServer::flush(Loop &loop, Connection &conn)
+{
+    if (loop.ring)
+        return flush_uring(loop, conn);
+
+    while (!conn.out.empty())
+    {
+        // Every queued response goes out in one sendmsg, straight from its own buffer.
+        iovec iov[kMaxIov];
+        std::size_t count = 0;
+        for (auto it = conn.out.begin(); it != conn.out.end() && count < kMaxIov; ++it, ++count)
+        {
+            const std::size_t skip = count == 0 ? conn.out_offset : 0;
+            iov[count].iov_base = const_cast<char *>(it->data() + skip);
+            iov[count].iov_len = it->size() - skip;
+        }
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            std::size_t sent = static_cast<std::size_t>(n);
+            while (sent > 0)
+            {
+                const std::size_t left = conn.out.front().size() - conn.out_offset;
+                if (sent < left)
+                {
+                    conn.out_offset += sent;
+                    break;
+                }
+                sent -= left;
+                conn.out.pop_front();
+                conn.out_offset = 0;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        close_connection(loop, conn);
+        return false;
+    }
+    if (conn.out.empty() && conn.closing)
+    {
+        close_connection(loop, conn);
+        return false;
+    }
+    update_interest(loop, conn);
+    return true;
+}
+
+void EventServer::update_interest(Loop &loop, Connection &conn)
+{
+    std::uint32_t want = 0;
+    if (!conn.closing && conn.in.size() < kMaxBufferedInput)
+        want |= EPOLLIN;
+    if (!conn.out.empty())
+        want |= EPOLLOUT;
+    if (want == conn.events)
+        return;
+    epoll_event ev{};
+    ev.events = want;
+    ev.data.u64 = conn.id;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+    conn.events = want;
+}
+
+void EventServer::close_connection(Loop &loop, Connection &conn)
+{
+    if (loop.ring)
+    {
+        if (!conn.closed)
+        {
+            // Wakes the pending recv (and any send) so their final completions arrive.
+            shutdown(conn.fd, SHUT_RDWR);
+            close(conn.fd);
+            conn.closed = true;
+        }
+        if (!conn.recv_armed && conn.sending.empty())
+            loop.conns.erase(conn.id);
+        return;
+    }
+
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    close(conn.fd);
+    loop.conns.erase(conn.id);
+}
+
+#ifdef KV_HAVE_IO_URING
+
+bool EventServer::setup_rings()
+{
+    for (auto &loop : loops_)
+    {
+        loop->ring = std::make_unique<IoUring>();
+        if (!loop->ring->init(kRingEntries) ||
+            !loop->ring->setup_buffer_ring(kRecvBufferGroup, kRecvBuffers, kReadChunk))
+            return false;
+    }
+    return true;
+}
+
+void EventServer::run_uring(Loop &loop)
+{
+    tls_loop = &loop;
+    IoUring &ring = *loop.ring;
+    arm_accept(loop);
+    arm_wake(loop);
+    while (!stopping_)
+    {
+        if (ring.submit_and_wait(1) < 0 && errno != EAGAIN && errno != EBUSY)
+        {
+            std::cerr << "EventServer: io_uring_enter failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+        while (io_uring_cqe *cqe = ring.peek_cqe())
+        {
+            const std::uint64_t data = cqe->user_data;
+            const int res = cqe->res;
+            const std::uint32_t flags = cqe->flags;
+            ring.cqe_seen();
+
+            const std::uint64_t id = data >> kOpBits;
+            switch (data & ((1u << kOpBits) - 1))
+            {
+            case kOpAccept:
+                on_accept(loop, res, flags);
+                break;
+            case kOpWake:
+                if (!stopping_)
+                    arm_wake(loop);
+                drain_completions(loop);
+                break;
+            case kOpRecv:
+                on_recv(loop, id, res, flags);
+                break;
+            case kOpSend:
+                on_send(loop, id, res);
+                break;
+            }
+        }
+    }
+    tls_loop = nullptr;
+}
+
+void EventServer::arm_accept(Loop &loop)
+{
+    io_uring_sqe *sqe = loop.ring->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd_;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = loop.multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = (kListenId << kOpBits) | kOpAccept;
+}
+
+void EventServer::arm_wake(Loop &loop)
+{
+    io_uring_sqe *sqe = loop.ring->get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop.wake_fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&loop.wake_count);
+    sqe->len = sizeof(loop.wake_count);
+    sqe->user_data = (kWakeId << kOpBits) | kOpWake;
+}
+
+void EventServer::arm_recv(Loop &loop, Connection &conn)
+{
+    io_uring_sqe *sqe = loop.ring->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kRecvBufferGroup;
+    sqe->ioprio = loop.multishot_recv ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = (conn.id << kOpBits) | kOpRecv;
+    conn.recv_armed = true;
+}
+
+void EventServer::submit_send(Loop &loop, Connection &conn)
+{
+    io_uring_sqe *sqe = loop.ring->get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn.fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(conn.sending.data() + conn.sent);
+    sqe->len = static_cast<std::uint32_t>(conn.sending.size() - conn.sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (conn.id << kOpBits) | kOpSend;
+}
+
+void EventServer::on_accept(Loop &loop, int res, std::uint32_t flags)
+{
+    if (res == -EINVAL && loop.multishot_accept)
+    {
+        // Older kernel: fall back to one accept per submission.
+        loop.multishot_accept = false;
+        arm_accept(loop);
+        return;
+    }
+    if (!(flags & IORING_CQE_F_MORE) && !stopping_)
+        arm_accept(loop);
+    if (res < 0)
+        return;
+
+    if (unix_path_.empty())
+    {
+        int yes = 1;
+        setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    auto conn = std::make_unique<Connection>();
+    conn->fd = res;
+    conn->id = loop.next_id++;
+    arm_recv(loop, *conn);
+    loop.conns.emplace(conn->id, std::move(conn));
+}
+
+void EventServer::on_recv(Loop &loop, std::uint64_t id, int res, std::uint32_t flags)
+{
+    auto it = loop.conns.find(id);
+    Connection *conn = it == loop.conns.end() ? nullptr : it->second.get();
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        const std::uint16_t bid = static_cast<std::uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+        if (conn && !conn->closed && res > 0)
+            conn->in.append(loop.ring->buffer(bid), static_cast<std::size_t>(res));
+        loop.ring->recycle_buffer(bid);
+    }
+    if (!conn)
+        return;
+    if (!(flags & IORING_CQE_F_MORE))
+        conn->recv_armed = false;
+    if (conn->closed)
+    {
+        close_connection(loop, *conn);
+        return;
+    }
+
+    if (res == -EINVAL && loop.multishot_recv)
+    {
+        loop.multishot_recv = false;
+    }
+    else if (res <= 0 && res != -ENOBUFS)
+    {
+        // Peer closed or reset; nothing more can be delivered.
+        close_connection(loop, *conn);
+        return;
+    }
+    if (conn->in.size() >= kMaxBufferedInput)
+    {
+        // A multishot recv cannot be paused, so a client this far ahead is dropped.
+        close_connection(loop, *conn);
+        return;
+    }
+    if (!conn->recv_armed)
+        arm_recv(loop, *conn);
+    if (res > 0)
+    {
+        process_input(loop, *conn);
+        flush(loop, *conn);
+    }
+}
+
+void EventServer::on_send(Loop &loop, std::uint64_t id, int res)
+{
+    auto it = loop.conns.find(id);
+    if (it == loop.conns.end())
+        return;
+    Connection &conn = *it->second;
+    if (res <= 0 || conn.closed)
+    {
+        conn.sending.clear();
+        close_connection(loop, conn);
+        return;
+    }
+    conn.sent += static_cast<std::size_t>(res);
+    if (conn.sent < conn.sending.size())
+    {
+        submit_send(loop, conn);
+        return;
+    }
+    conn.sending.clear();
+    conn.sent = 0;
+    flush_uring(loop, conn);
+}
+
+bool EventServer::flush_uring(Loop &loop, Connection &conn)
+{
+    if (conn.closed)
+        return false;
+    // One send in flight per connection; whatever is queued meanwhile goes when it completes.
+    if (!conn.sending.empty())
+        return true;
+    if (conn.out.empty())
+    {
+        if (!conn.closing)
+            return true;
+        close_connection(loop, conn);
+        return false;
+    }
+    // The ring sends one buffer per connection, so queued responses are joined here.
+    if (conn.out.size() == 1)
+    {
+        conn.sending = std::move(conn.out.front());
+    }
+    else
+    {
+        std::size_t bytes = 0;
+        for (const std::string &chunk : conn.out)
+            bytes += chunk.size();
+        conn.sending.reserve(bytes);
+        for (const std::string &chunk : conn.out)
+            conn.sending += chunk;
+    }
+    conn.out.clear();
+    submit_send(loop, conn);
+    return true;
+}
+
+#else
+
+bool EventServer::setup_rings()
+{
+    return false;
+}
+
+void EventServer::run_uring(Loop &)
+{
+}
+
+bool EventServer::flush_uring(Loop &, Connection &)
+{
+    return false;
+}
+
+#endif
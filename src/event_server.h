@@ -0,0 +1,168 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <deque>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+#include "kv_service.h"
+
+// Event-driven front end for the point /kv routes (GET, PUT and DELETE
+// /kv/<key>, POST /kv) over HTTP/1.1, for get/gets/set/delete over the
+// memcached text protocol, or for GET/SET/DEL/MGET/MSET/EXISTS/EXPIRE over
+// RESP2. One epoll loop per thread owns its connections and
+// parses requests incrementally. Cache hits are answered inline; anything that
+// needs MySQL goes through KVService's callback API and the response is written
+// when the callback posts it back, so idle keep-alive connections cost a
+// buffer, not a thread.
+//
+// Every protocol is pipelined: all requests in a read are parsed and started at
+// once, and responses are written in request order, gathered into one sendmsg.
+// A write waits for the requests before it and holds back those after it, so a
+// pipeline behaves as if its requests ran one by one.
+//
+// With Io::Uring each loop drives its sockets through an io_uring instead:
+// multishot accept and recv into a registered buffer ring, and sends queued on
+// the same ring, so a busy loop makes one io_uring_enter per batch of events
+// rather than a syscall per read and write.
+class IoUring;
+
+class EventServer
+{
+public:
+    enum class Io
+    {
+        Epoll,
+        Uring
+    };
+
+    // The wire protocol spoken on the listening port.
+    enum class Protocol
+    {
+        Http,
+        Memcached,
+        Resp
+    };
+
+    // Io::Uring falls back to epoll when the kernel or build lacks support.
+    EventServer(KVService &service, std::size_t loops, Io io = Io::Epoll, Protocol protocol = Protocol::Http);
+    ~EventServer();
+
+    EventServer(const EventServer &) = delete;
+    EventServer &operator=(const EventServer &) = delete;
+
+    // Binds, then serves on the calling thread plus loops - 1 helpers until stop().
+    bool listen(const std::string &host, int port);
+    // Same, on a Unix domain socket at `path`; a stale socket file there is replaced,
+    // and the file is removed again on destruction.
+    bool listen_unix(const std::string &path);
+    void stop();
+
+private:
+    struct Connection
+    {
+        int fd;
+        std::uint64_t id;
+        std::string in;
+        std::size_t in_start = 0;    // bytes of `in` already parsed, dropped after each batch
+        std::deque<std::string> out; // responses ready to send, in order
+        std::size_t out_offset = 0;  // bytes of out.front() already sent
+        std::uint32_t events = 0;
+        // Responses not yet moved to `out`, in request order. Requests complete in
+        // any order; a response is written once everything before it has been.
+        std::deque<std::optional<std::string>> pipeline;
+        std::uint64_t first_seq = 0; // sequence number of pipeline.front()
+        bool exclusive = false;      // a write is in flight; parse nothing until it answers
+        bool last = false;           // no request after the queued ones will be parsed
+        bool keep_alive = true;      // of the HTTP request being dispatched
+        bool sent_continue = false;  // "100 Continue" already sent for the pending body
+        bool closing = false;        // close once `out` drains
+        bool pending_flush = false;  // queued for a flush at the end of drain_completions
+        // io_uring only: the kernel may still reference `sending` and the
+        // socket after close, so the connection lingers until both complete.
+        std::string sending;
+        std::size_t sent = 0;
+        bool recv_armed = false;
+        bool closed = false;
+    };
+
+    // Headers of an HTTP request that shape its response.
+    struct RequestHeaders
+    {
+        std::optional<std::string> if_match;
+        std::string if_none_match;
+        bool accept_gzip = false;
+    };
+
+    struct Completion
+    {
+        std::uint64_t conn_id;
+        std::uint64_t seq;
+        std::string response;
+    };
+
+    struct Loop
+    {
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::thread thread;
+        std::unordered_map<std::uint64_t, std::unique_ptr<Connection>> conns;
+        std::uint64_t next_id = kFirstConnId;
+        std::mutex completions_mutex;
+        std::vector<Completion> completions;
+        std::uint64_t wake_count = 0;  // target of the ring's eventfd read
+        bool multishot_accept = true;  // cleared on kernels without multishot accept (5.19)
+        bool multishot_recv = true;    // or multishot recv (6.0)
+        std::unique_ptr<IoUring> ring; // last, so pending ops are torn down before conns
+    };
+
+    static const std::uint64_t kListenId = 0;
+    static const std::uint64_t kWakeId = 1;
+    static const std::uint64_t kFirstConnId = 2;
+
+    bool serve();
+    void run(Loop &loop);
+    void accept_all(Loop &loop);
+    void on_readable(Loop &loop, Connection &conn);
+    void process_input(Loop &loop, Connection &conn);
+    bool next_http(Loop &loop, Connection &conn);
+    bool next_memcached(Loop &loop, Connection &conn);
+    void memcached_get(Loop &loop, Connection &conn, std::vector<std::string> keys, bool with_cas);
+    bool next_resp(Loop &loop, Connection &conn);
+    void resp_dispatch(Loop &loop, Connection &conn, std::vector<std::string> args);
+    void dispatch(Loop &loop, Connection &conn, const std::string &method, const std::string &target,
+                  std::string body, const RequestHeaders &headers, bool exclusive);
+    std::uint64_t open_slot(Connection &conn, bool exclusive = false);
+    void answer(Connection &conn, std::string response, bool keep_alive = true);
+    void queue_output(Connection &conn, std::string data);
+    void complete(Loop *loop, std::uint64_t conn_id, std::uint64_t seq, std::string response);
+    void apply(Connection &conn, std::uint64_t seq, std::string response);
+    void drain_completions(Loop &loop);
+    bool flush(Loop &loop, Connection &conn); // false if the connection was closed
+    void update_interest(Loop &loop, Connection &conn);
+    void close_connection(Loop &loop, Connection &conn);
+
+    bool setup_rings();
+    void run_uring(Loop &loop);
+    void arm_accept(Loop &loop);
+    void arm_wake(Loop &loop);
+    void arm_recv(Loop &loop, Connection &conn);
+    void submit_send(Loop &loop, Connection &conn);
+    void on_accept(Loop &loop, int res, std::uint32_t flags);
+    void on_recv(Loop &loop, std::uint64_t id, int res, std::uint32_t flags);
+    void on_send(Loop &loop, std::uint64_t id, int res);
+    bool flush_uring(Loop &loop, Connection &conn);
+
+    KVService &service_;
+    Io io_;
+    Protocol protocol_;
+    std::vector<std::unique_ptr<Loop>> loops_;
+    int listen_fd_ = -1;
+    std::string unix_path_;
+    std::atomic<bool> stopping_{false};
+};
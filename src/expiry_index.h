@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstddef>
+
+// Deadlines set with EXPIRE (or SET ... EX). Nothing deletes a key when its deadline
+// passes; the next read finds it expired and deletes it, so an entry lives until its
+// key is read, rewritten or deleted. Deadlines are kept in memory only and are lost
+// on restart. Striped by key hash like RecentWrites.
+class ExpiryIndex
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void set(const std::string &key, Clock::time_point deadline)
+    {
+        Stripe &stripe = stripe_for(key);
+        std::lock_guard<std::mutex> lock(stripe.mu);
+        if (stripe.deadlines.insert_or_assign(key, deadline).second)
+            count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void clear(const std::string &key)
+    {
+        // No key has a deadline in the common case, so skip the lock.
+        if (count_.load(std::memory_order_relaxed) == 0)
+            return;
+        Stripe &stripe = stripe_for(key);
+        std::lock_guard<std::mutex> lock(stripe.mu);
+        if (stripe.deadlines.erase(key))
+            count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    bool expired(const std::string &key)
+    {
+        if (count_.load(std::memory_order_relaxed) == 0)
+            return false;
+        Stripe &stripe = stripe_for(key);
+        std::lock_guard<std::mutex> lock(stripe.mu);
+        auto it = stripe.deadlines.find(key);
+        return it != stripe.deadlines.end() && it->second <= Clock::now();
+    }
+
+private:
+    static const std::size_t kStripes = 16;
+
+    struct Stripe
+    {
+        std::mutex mu;
+        std::unordered_map<std::string, Clock::time_point> deadlines;
+    };
+
+    Stripe &stripe_for(const std::string &key)
+    {
+        return stripes_[std::hash<std::string>{}(key) % kStripes];
+    }
+
+    Stripe stripes_[kStripes];
+    std::atomic<std::size_t> count_{0};
+};
@@ -0,0 +1,108 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <cstddef>
+#ifdef KV_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "request_arena.h"
+
+// gzip Content-Encoding for large values, compressed once when they are cached.
+namespace gzip
+{
+    // Compression runs on whichever thread completes the write or the fill, often a
+    // DB loop, so speed matters more than the last 20% of ratio.
+#ifdef KV_HAVE_ZLIB
+    static const int kLevel = Z_BEST_SPEED;
+#endif
+
+#ifdef KV_HAVE_ZLIB
+    // deflate's state and window, a few hundred KB per stream, taken from the
+    // request arena and dropped with it.
+    inline voidpf arena_alloc(voidpf opaque, uInt items, uInt size)
+    {
+        return static_cast<RequestArena *>(opaque)->allocate(std::size_t(items) * size);
+    }
+
+    inline void arena_free(voidpf, voidpf) {}
+#endif
+
+    inline bool available()
+    {
+#ifdef KV_HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Sets `out` to `data` as one gzip member. False without zlib, or if zlib fails.
+    inline bool compress(std::string_view data, std::string &out)
+    {
+#ifdef KV_HAVE_ZLIB
+        z_stream z{};
+        if (request_arena::depth())
+        {
+            z.zalloc = arena_alloc;
+            z.zfree = arena_free;
+            z.opaque = &request_arena::local();
+        }
+        // 15 window bits, +16 for a gzip header and trailer rather than zlib's.
+        if (deflateInit2(&z, kLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        // Compressed into scratch sized for the worst case, then copied out at its
+        // real size, so `out` carries no slack.
+        request_arena::Buffer scratch(deflateBound(&z, data.size()));
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+        z.avail_in = static_cast<uInt>(data.size());
+        z.next_out = reinterpret_cast<Bytef *>(scratch.data());
+        z.avail_out = static_cast<uInt>(scratch.size());
+        const int status = deflate(&z, Z_FINISH);
+        if (status == Z_STREAM_END)
+            out.assign(scratch.data(), z.total_out);
+        deflateEnd(&z);
+        return status == Z_STREAM_END;
+#else
+        (void)data;
+        (void)out;
+        return false;
+#endif
+    }
+
+    // True if an Accept-Encoding header lists gzip (or *) without q=0.
+    inline bool accepted(std::string_view header)
+    {
+        std::size_t pos = 0;
+        while (pos < header.size())
+        {
+            std::size_t comma = header.find(',', pos);
+            if (comma == std::string_view::npos)
+                comma = header.size();
+            std::string_view item = header.substr(pos, comma - pos);
+            pos = comma + 1;
+
+            std::size_t semi = item.find(';');
+            std::string_view coding = item.substr(0, semi);
+            while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t'))
+                coding.remove_prefix(1);
+            while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t'))
+                coding.remove_suffix(1);
+            if (coding != "gzip" && coding != "x-gzip" && coding != "*")
+                continue;
+            if (semi == std::string_view::npos)
+                return true;
+            // "q=0", "q=0.0" and so on refuse the coding; any other weight accepts it.
+            std::string_view params = item.substr(semi + 1);
+            std::size_t q = params.find("q=");
+            if (q == std::string_view::npos)
+                return true;
+            for (std::size_t i = q + 2; i < params.size() && params[i] != ';'; ++i)
+            {
+                if (params[i] >= '1' && params[i] <= '9')
+                    return true;
+            }
+            return false;
+        }
+        return false;
+    }
+}
@@ -0,0 +1,187 @@
+#include "io_uring_ring.h"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+IoUring::~IoUring()
+{
+    if (buf_ring_)
+        munmap(buf_ring_, buf_ring_size_);
+    if (buffers_)
+        munmap(buffers_, buffers_size_);
+    if (sqes_)
+        munmap(sqes_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_)
+        munmap(cq_ptr_, cq_map_size_);
+    if (sq_ptr_)
+        munmap(sq_ptr_, sq_map_size_);
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool IoUring::init(unsigned entries)
+{
+    io_uring_params params{};
+    // Completions are only reaped by the owning loop, so the kernel need not
+    // interrupt it with task work (5.19+); retry plainly on older kernels.
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    fd_ = sys_io_uring_setup(entries, &params);
+    if (fd_ < 0 && errno == EINVAL)
+    {
+        params = io_uring_params{};
+        fd_ = sys_io_uring_setup(entries, &params);
+    }
+    if (fd_ < 0)
+        return false;
+
+    sq_map_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_map_size_ > sq_map_size_)
+        sq_map_size_ = cq_map_size_;
+
+    sq_ptr_ = mmap(nullptr, sq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED)
+    {
+        sq_ptr_ = nullptr;
+        return false;
+    }
+    if (single_mmap)
+    {
+        cq_ptr_ = sq_ptr_;
+    }
+    else
+    {
+        cq_ptr_ = mmap(nullptr, cq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED)
+        {
+            cq_ptr_ = nullptr;
+            return false;
+        }
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_entries_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sqe_tail_ = *sq_tail_;
+
+    char *cq = static_cast<char *>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+}
+
+io_uring_sqe *IoUring::get_sqe()
+{
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    while (sqe_tail_ - head >= sq_entries_)
+    {
+        submit_and_wait(0);
+        head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+    const unsigned index = sqe_tail_ & sq_mask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    ++sqe_tail_;
+    return sqe;
+}
+
+int IoUring::submit_and_wait(unsigned wait_nr)
+{
+    const unsigned to_submit = sqe_tail_ - *sq_tail_;
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    for (;;)
+    {
+        int ret = sys_io_uring_enter(fd_, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0 && errno == EINTR)
+        {
+            // Anything not consumed before the signal was still submitted; only wait again.
+            if (!wait_nr)
+                return 0;
+            ret = sys_io_uring_enter(fd_, 0, wait_nr, IORING_ENTER_GETEVENTS);
+            if (ret < 0 && errno == EINTR)
+                continue;
+        }
+        return ret;
+    }
+}
+
+io_uring_cqe *IoUring::peek_cqe()
+{
+    const unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+        return nullptr;
+    return &cqes_[head & cq_mask_];
+}
+
+void IoUring::cqe_seen()
+{
+    __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+bool IoUring::setup_buffer_ring(std::uint16_t group, unsigned count, unsigned size)
+{
+    buf_ring_size_ = count * sizeof(io_uring_buf);
+    void *ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+    buf_ring_ = static_cast<io_uring_buf *>(ring);
+
+    buffers_size_ = static_cast<std::size_t>(count) * size;
+    void *buffers = mmap(nullptr, buffers_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED)
+        return false;
+    buffers_ = static_cast<char *>(buffers);
+    buffer_size_ = size;
+    buf_mask_ = static_cast<std::uint16_t>(count - 1);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring_);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_io_uring_register(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+    for (unsigned bid = 0; bid < count; ++bid)
+        recycle_buffer(static_cast<std::uint16_t>(bid));
+    return true;
+}
+
+void IoUring::recycle_buffer(std::uint16_t bid)
+{
+    io_uring_buf &buf = buf_ring_[buf_tail_ & buf_mask_];
+    buf.addr = reinterpret_cast<std::uint64_t>(buffer(bid));
+    buf.len = buffer_size_;
+    buf.bid = bid;
+    ++buf_tail_;
+    __atomic_store_n(&buf_ring_[0].resv, buf_tail_, __ATOMIC_RELEASE);
+}
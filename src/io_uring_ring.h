@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// Minimal io_uring ring over the raw syscalls, so the server needs nothing
+// beyond kernel headers. Single-threaded: one ring per event loop.
+class IoUring
+{
+public:
+    IoUring() = default;
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    bool init(unsigned entries);
+
+    // Next free submission entry, zeroed. Flushes the queue to the kernel if it is full.
+    io_uring_sqe *get_sqe();
+    // Submits everything queued and waits for at least `wait_nr` completions.
+    int submit_and_wait(unsigned wait_nr);
+
+    // Oldest unconsumed completion, or nullptr; cqe_seen() releases it back to the kernel.
+    io_uring_cqe *peek_cqe();
+    void cqe_seen();
+
+    // Registers `count` (a power of two) receive buffers of `size` bytes as provided-buffer
+    // group `group`, for recv with IOSQE_BUFFER_SELECT.
+    bool setup_buffer_ring(std::uint16_t group, unsigned count, unsigned size);
+    const char *buffer(std::uint16_t bid) const { return buffers_ + static_cast<std::size_t>(bid) * buffer_size_; }
+    // Hands a consumed buffer back to the kernel.
+    void recycle_buffer(std::uint16_t bid);
+
+private:
+    int fd_ = -1;
+
+    void *sq_ptr_ = nullptr;
+    std::size_t sq_map_size_ = 0;
+    unsigned *sq_head_ = nullptr;
+    unsigned *sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned *sq_array_ = nullptr;
+    unsigned sqe_tail_ = 0;  // entries handed out, not necessarily published
+    io_uring_sqe *sqes_ = nullptr;
+    std::size_t sqes_size_ = 0;
+
+    void *cq_ptr_ = nullptr;
+    std::size_t cq_map_size_ = 0;
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+
+    // Indexed as plain io_uring_buf entries: compiled as C++, the header's flexible-array
+    // wrapper shifts io_uring_buf_ring::bufs off the kernel's layout. The ring tail lives
+    // in bufs[0].resv.
+    io_uring_buf *buf_ring_ = nullptr;
+    std::size_t buf_ring_size_ = 0;
+    char *buffers_ = nullptr;
+    std::size_t buffers_size_ = 0;
+    unsigned buffer_size_ = 0;
+    std::uint16_t buf_mask_ = 0;
+    std::uint16_t buf_tail_ = 0;
+};
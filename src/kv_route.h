@@ -0,0 +1,37 @@
+#pragma once
+#include <string_view>
+
+// Hand-written matcher for "/kv/<key>", replacing the std::regex route
+// R"(/kv/([\w\-%\.]+))" with the same key alphabet and no allocation.
+// Shared by the httplib and event-driven front ends.
+namespace kv_route
+{
+    inline bool is_key_char(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+               c == '_' || c == '-' || c == '%' || c == '.';
+    }
+
+    inline bool valid_key(std::string_view key)
+    {
+        if (key.empty())
+            return false;
+        for (char c : key)
+        {
+            if (!is_key_char(c))
+                return false;
+        }
+        return true;
+    }
+
+    // `path` is already percent-decoded, like httplib's req.path. On a match `key`
+    // views into `path`.
+    inline bool match_key(std::string_view path, std::string_view &key)
+    {
+        constexpr std::string_view prefix = "/kv/";
+        if (path.size() <= prefix.size() || path.compare(0, prefix.size(), prefix) != 0)
+            return false;
+        key = path.substr(prefix.size());
+        return valid_key(key);
+    }
+}
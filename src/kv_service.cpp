@@ -0,0 +1,643 @@
+#include "kv_service.h"
+#include <iostream>
+#include <algorithm>
+#include <charconv>
+#include <future>
+#include <cstdio>
+#include <memory>
+#include "gzip.h"
+#include "request_arena.h"
+
+// increment() gives up with Busy after this many lost races against other writers.
+static const unsigned kMaxIncrementAttempts = 16;
+
+// TTLs are capped here, far beyond any real use, so a deadline always fits the
+// steady clock's nanoseconds.
+static const std::chrono::hours kMaxTtl{24 * 365 * 100};
+
+// Bytes of a spooled upload read back per piece handed to MySQL.
+static const std::size_t kSpoolReadBytes = 256 * 1024;
+
+// A Redis-style integer: optional '-', then base-10 digits, nothing else.
+static bool parse_counter(const std::string &text, std::int64_t &out)
+{
+    const char *end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, out);
+    return !text.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+KVService::KVService(LRUCache<std::string, VersionedValue> &cache, DBHandler &db, WorkerPool *offload)
+    : cache_(cache), db_(db), offload_(offload)
+{
+}
+
+KVService::Status KVService::get(const std::string &key, VersionedValue &entry, bool accept_gzip, std::uint64_t *size)
+{
+    if (expired(key))
+    {
+        Status status = remove(key);
+        return status == Status::Ok ? Status::NotFound : status;
+    }
+
+    // Try cache first
+    if (lookup(key, entry, accept_gzip))
+    {
+        if (size)
+            *size = entry.value.size();
+        return Status::Ok;
+    }
+
+    // Fetch from DB
+    const auto started = Clock::now();
+    if (!enter_slow_lane())
+        return Status::Busy;
+    Status status = fetch(key, entry, size);
+    leave_slow_lane(started);
+    return status;
+}
+
+KVService::Status KVService::put(const std::string &key, std::string value, std::uint64_t *written)
+{
+    const auto started = Clock::now();
+    if (!enter_slow_lane())
+        return Status::Busy;
+    Status status = store(key, std::move(value), written);
+    leave_slow_lane(started);
+    return status;
+}
+
+KVService::Status KVService::put_stream(const std::string &key,
+                                        const std::function<bool(const DBHandler::ChunkSink &)> &produce,
+                                        std::uint64_t *written)
+{
+    // The body arrives at the client's pace, so it is spooled to a temporary file
+    // first: a slow upload holds no pooled connection, slow-lane slot or admission
+    // slot while it trickles in.
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> spool(std::tmpfile(), std::fclose);
+    if (!spool)
+    {
+        std::cerr << "Cannot create a spool file for " << key << "\n";
+        return Status::Error;
+    }
+    const bool received = produce([&spool](const char *data, std::size_t len)
+                                  { return std::fwrite(data, 1, len, spool.get()) == len; });
+    if (!received || std::fflush(spool.get()) != 0)
+        return Status::Error;
+    std::rewind(spool.get());
+
+    if (!enter_slow_lane())
+        return Status::Busy;
+    const std::uint64_t version = next_version();
+    const bool ok = db_.put_stream(key, version, [&spool](const DBHandler::ChunkSink &sink)
+                                   {
+        request_arena::Buffer piece(kSpoolReadBytes);
+        std::size_t n;
+        while ((n = std::fread(piece.data(), 1, piece.size(), spool.get())) > 0) {
+            if (!sink(piece.data(), n))
+                return false;
+        }
+        return !std::ferror(spool.get()); });
+    // Sending takes time in proportion to the value's size, which says nothing
+    // about MySQL's latency under load.
+    leave_slow_lane();
+    if (!ok)
+        return Status::Error;
+    invalidate(key);
+    if (written)
+        *written = version;
+    return Status::Ok;
+}
+
+KVService::Status KVService::read_range(const std::string &key, std::uint64_t version, std::uint64_t offset,
+                                        std::size_t length, std::string &out)
+{
+    bool matched = false;
+    if (!db_.read_range(key, version, offset, length, out, matched))
+        return Status::Error;
+    return matched ? Status::Ok : Status::NotFound;
+}
+
+KVService::Status KVService::remove(const std::string &key)
+{
+    const auto started = Clock::now();
+    if (!enter_slow_lane())
+        return Status::Busy;
+    Status status = erase(key);
+    leave_slow_lane(started);
+    return status;
+}
+
+void KVService::get(const std::string &key, Callback done, bool accept_gzip)
+{
+    if (expired(key))
+    {
+        remove(key, [done = std::move(done)](Status status, VersionedValue)
+               { done(status == Status::Ok ? Status::NotFound : status, {}); });
+        return;
+    }
+
+    VersionedValue entry;
+    if (lookup(key, entry, accept_gzip))
+    {
+        done(Status::Ok, std::move(entry));
+        return;
+    }
+
+    if (!admit())
+    {
+        done(Status::Busy, {});
+        return;
+    }
+    const auto started = Clock::now();
+
+    if (db_.async_enabled())
+    {
+        db_.get_async(key, [this, key, started, done = std::move(done)](bool ok, std::optional<VersionedValue> found)
+                      {
+            finish(started);
+            if (!ok) {
+                done(Status::Error, {});
+            } else if (!found.has_value()) {
+                done(Status::NotFound, {});
+            } else {
+                compress(found.value());
+                fill(key, found.value());
+                done(Status::Ok, std::move(found.value()));
+            } });
+        return;
+    }
+
+    if (!offload([this, key, started, done]()
+                 {
+        VersionedValue fetched;
+        Status status = fetch(key, fetched);
+        finish(started);
+        done(status, std::move(fetched)); }))
+    {
+        abandon();
+        done(Status::Busy, {});
+    }
+}
+
+void KVService::put(const std::string &key, std::string value, Callback done)
+{
+    if (!admit())
+    {
+        done(Status::Busy, {});
+        return;
+    }
+    const auto started = Clock::now();
+
+    if (db_.async_enabled())
+    {
+        const std::uint64_t version = next_version();
+        db_.put_async(key, value, version, [this, key, value, version, started, done = std::move(done)](bool ok) mutable
+                      {
+            finish(started);
+            if (ok) {
+                fill(key, VersionedValue{std::move(value), version});
+                for (auto *peer : peers_)
+                    peer->remove(key);
+                clear_ttl(key);
+            }
+            done(ok ? Status::Ok : Status::Error, VersionedValue{{}, version}); });
+        return;
+    }
+
+    if (!offload([this, key, value = std::move(value), started, done]() mutable
+                 {
+        std::uint64_t version = 0;
+        Status status = store(key, std::move(value), &version);
+        finish(started);
+        done(status, VersionedValue{{}, version}); }))
+    {
+        abandon();
+        done(Status::Busy, {});
+    }
+}
+
+void KVService::remove(const std::string &key, Callback done)
+{
+    if (!admit())
+    {
+        done(Status::Busy, {});
+        return;
+    }
+    const auto started = Clock::now();
+
+    if (db_.async_enabled())
+    {
+        db_.remove_async(key, [this, key, started, done = std::move(done)](bool ok, bool existed)
+                         {
+            finish(started);
+            if (!ok) {
+                done(Status::Error, {});
+                return;
+            }
+            invalidate(key);
+            done(existed ? Status::Ok : Status::NotFound, {}); });
+        return;
+    }
+
+    if (!offload([this, key, started, done]()
+                 {
+        Status status = erase(key);
+        finish(started);
+        done(status, {}); }))
+    {
+        abandon();
+        done(Status::Busy, {});
+    }
+}
+
+KVService::Status KVService::compare_and_set(const std::string &key, std::string value,
+                                             std::optional<std::uint64_t> expected, VersionedValue &entry)
+{
+    const auto started = Clock::now();
+    if (!enter_slow_lane())
+        return Status::Busy;
+    Status status = wait_for([&](Callback done)
+                             { swap_if(key, std::move(value), expected, std::move(done)); }, entry);
+    leave_slow_lane(started);
+    return status;
+}
+
+KVService::Status KVService::increment(const std::string &key, std::int64_t delta, VersionedValue &entry)
+{
+    const auto started = Clock::now();
+    if (!enter_slow_lane())
+        return Status::Busy;
+    Status status = wait_for([&](Callback done)
+                             { add(key, delta, 0, std::move(done)); }, entry);
+    leave_slow_lane(started);
+    return status;
+}
+
+void KVService::compare_and_set(const std::string &key, std::string value, std::optional<std::uint64_t> expected,
+                                Callback done)
+{
+    submit([this, key, value = std::move(value), expected](Callback finished) mutable
+           { swap_if(key, std::move(value), expected, std::move(finished)); },
+           std::move(done));
+}
+
+void KVService::increment(const std::string &key, std::int64_t delta, Callback done)
+{
+    submit([this, key, delta](Callback finished)
+           { add(key, delta, 0, std::move(finished)); },
+           std::move(done));
+}
+
+void KVService::swap_if(const std::string &key, std::string value, std::optional<std::uint64_t> expected,
+                        Callback done)
+{
+    if (expired(key))
+    {
+        db_.remove_async(key, [this, key, done = std::move(done)](bool ok, bool)
+                         {
+            if (ok)
+                invalidate(key);
+            done(ok ? Status::NotFound : Status::Error, {}); });
+        return;
+    }
+
+    const std::uint64_t version = next_version();
+    db_.update_if_async(key, value, version, expected, [this, key, value, version, done = std::move(done)](bool ok, bool applied) mutable
+                        {
+        if (!ok) {
+            done(Status::Error, {});
+            return;
+        }
+        if (applied) {
+            fill(key, VersionedValue{std::move(value), version});
+            for (auto *peer : peers_)
+                peer->remove(key);
+            clear_ttl(key);
+            done(Status::Ok, VersionedValue{{}, version});
+            return;
+        }
+        // Either the key is gone or another write moved its version on; refresh the
+        // cache from the primary while telling the two apart.
+        db_.get_latest_async(key, [this, key, done = std::move(done)](bool ok, std::optional<VersionedValue> found)
+                             {
+            if (!ok) {
+                done(Status::Error, {});
+            } else if (!found.has_value()) {
+                invalidate(key);
+                done(Status::NotFound, {});
+            } else {
+                const std::uint64_t current = found->version;
+                fill(key, std::move(found.value()));
+                done(Status::Conflict, VersionedValue{{}, current});
+            } }); });
+}
+
+void KVService::add(const std::string &key, std::int64_t delta, unsigned attempt, Callback done)
+{
+    if (attempt == kMaxIncrementAttempts)
+    {
+        done(Status::Busy, {});
+        return;
+    }
+    if (attempt == 0 && expired(key))
+    {
+        // Counts from 0 again, like a missing key.
+        db_.remove_async(key, [this, key, delta, done = std::move(done)](bool ok, bool) mutable
+                         {
+            if (!ok) {
+                done(Status::Error, {});
+                return;
+            }
+            invalidate(key);
+            add(key, delta, 1, std::move(done)); });
+        return;
+    }
+
+    auto apply = [this, key, delta, attempt, done](std::optional<VersionedValue> current)
+    {
+        std::int64_t base = 0;
+        std::int64_t sum = 0;
+        if ((current.has_value() && !parse_counter(current->value, base)) || __builtin_add_overflow(base, delta, &sum))
+        {
+            done(Status::Invalid, {});
+            return;
+        }
+        std::string text = std::to_string(sum);
+        const std::uint64_t version = next_version();
+        // The expiry, if any, is kept, as Redis does for INCR.
+        auto written = [this, key, delta, attempt, text, version, done](bool ok, bool applied)
+        {
+            if (!ok)
+                done(Status::Error, {});
+            else if (!applied)
+                add(key, delta, attempt + 1, done);
+            else
+            {
+                fill(key, VersionedValue{text, version});
+                for (auto *peer : peers_)
+                    peer->remove(key);
+                done(Status::Ok, VersionedValue{text, version});
+            }
+        };
+        if (current.has_value())
+            db_.update_if_async(key, text, version, current->version, std::move(written));
+        else
+            db_.insert_if_absent_async(key, text, version, std::move(written));
+    };
+
+    // The first try trusts the cache; after losing a race, read the primary.
+    VersionedValue cached;
+    if (attempt == 0 && lookup(key, cached, false))
+    {
+        apply(std::move(cached));
+        return;
+    }
+    db_.get_latest_async(key, [apply, done](bool ok, std::optional<VersionedValue> found)
+                         {
+        if (!ok)
+            done(Status::Error, {});
+        else
+            apply(std::move(found)); });
+}
+
+KVService::Status KVService::wait_for(const std::function<void(Callback)> &op, VersionedValue &entry)
+{
+    // Completes inline with the blocking DB client; with the async one, on a DB loop.
+    std::promise<std::pair<Status, VersionedValue>> result;
+    std::future<std::pair<Status, VersionedValue>> ready = result.get_future();
+    op([&result](Status status, VersionedValue e)
+       { result.set_value({status, std::move(e)}); });
+    auto [status, e] = ready.get();
+    entry = std::move(e);
+    return status;
+}
+
+void KVService::submit(std::function<void(Callback)> op, Callback done)
+{
+    if (!admit())
+    {
+        done(Status::Busy, {});
+        return;
+    }
+    const auto started = Clock::now();
+    Callback finished = [this, started, done](Status status, VersionedValue entry)
+    {
+        finish(started);
+        done(status, std::move(entry));
+    };
+
+    if (db_.async_enabled())
+    {
+        op(std::move(finished));
+        return;
+    }
+    if (!offload([op = std::move(op), finished = std::move(finished)]() mutable
+                 { op(std::move(finished)); }))
+    {
+        abandon();
+        done(Status::Busy, {});
+    }
+}
+
+void KVService::fill(const std::string &key, VersionedValue entry)
+{
+    if (!cacheable(entry))
+    {
+        // Whatever version is cached, it must not outlive this one.
+        cache_.remove(key);
+        return;
+    }
+    prepare(entry);
+    const std::uint64_t version = entry.version;
+    cache_.put_if(key, std::move(entry), [version](const VersionedValue &cached)
+                  { return cached.version < version; });
+}
+
+bool KVService::lookup(const std::string &key, VersionedValue &entry, bool accept_gzip)
+{
+    // Only the packed bytes are copied under the cache lock; they are unpacked after.
+    if (!cache_.visit(key, [&entry, accept_gzip](const VersionedValue &cached)
+                      {
+        entry.version = cached.version;
+        entry.gzipped = cached.gzipped;
+        if (!accept_gzip || !cached.gzipped) {
+            entry.value = cached.value;
+            entry.raw_size = cached.raw_size;
+        } }))
+        return false;
+    if (!entry.raw_size)
+        return true;
+
+    const auto started = Clock::now();
+    const bool ok = unpack(entry);
+    unpacked_.fetch_add(1, std::memory_order_relaxed);
+    unpack_ns_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - started).count(),
+                         std::memory_order_relaxed);
+    if (!ok)
+    {
+        // Corrupt; drop it and read the key from MySQL instead.
+        std::cerr << "Dropping undecodable cache entry for " << key << "\n";
+        cache_.remove(key);
+        entry = VersionedValue{};
+    }
+    return ok;
+}
+
+void KVService::compress(VersionedValue &entry) const
+{
+    if (!compress_min_bytes_ || entry.gzipped || entry.value.size() < compress_min_bytes_ || !cacheable(entry))
+        return;
+    // Often on a DB loop or worker rather than a request thread, so it scopes its
+    // own scratch.
+    request_arena::Scope scope;
+    std::string packed;
+    // Not worth caching unless it saves at least an eighth.
+    if (!gzip::compress(entry.value, packed) || packed.size() > entry.value.size() - entry.value.size() / 8)
+        return;
+    entry.gzipped = std::make_shared<const std::string>(std::move(packed));
+}
+
+void KVService::prepare(VersionedValue &entry)
+{
+    request_arena::Scope scope;
+    compress(entry);
+    if (!pack_min_bytes_ || entry.value.size() < pack_min_bytes_)
+        return;
+    const auto started = Clock::now();
+    if (pack(entry, pack_min_bytes_))
+        packed_.fetch_add(1, std::memory_order_relaxed);
+    pack_ns_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - started).count(),
+                       std::memory_order_relaxed);
+}
+
+KVService::Stats KVService::stats()
+{
+    return Stats{cache_.counters(), packed_.load(std::memory_order_relaxed), pack_ns_.load(std::memory_order_relaxed),
+                 unpacked_.load(std::memory_order_relaxed), unpack_ns_.load(std::memory_order_relaxed)};
+}
+
+void KVService::invalidate(const std::string &key)
+{
+    cache_.remove(key);
+    for (auto *peer : peers_)
+        peer->remove(key);
+    clear_ttl(key);
+}
+
+bool KVService::set_ttl(const std::string &key, std::chrono::milliseconds ttl)
+{
+    if (!expiry_)
+        return false;
+    expiry_->set(key, ExpiryIndex::Clock::now() + std::min<std::chrono::milliseconds>(ttl, kMaxTtl));
+    return true;
+}
+
+KVService::Status KVService::fetch(const std::string &key, VersionedValue &entry, std::uint64_t *size)
+{
+    std::optional<VersionedValue> opt;
+    std::uint64_t full = 0;
+    bool failed = false;
+    if (size && stream_threshold_)
+    {
+        opt = db_.get_prefix(key, stream_threshold_, full, failed);
+    }
+    else
+    {
+        opt = db_.get(key, failed);
+        if (opt.has_value())
+            full = opt->value.size();
+    }
+    if (failed)
+        return Status::Error;
+    if (!opt.has_value())
+        return Status::NotFound;
+    if (size)
+        *size = full;
+    // Only part of a streamed value was read; it is not cached anyway.
+    if (full == opt->value.size())
+    {
+        compress(opt.value());
+        fill(key, opt.value());
+    }
+    entry = std::move(opt.value());
+    return Status::Ok;
+}
+
+KVService::Status KVService::store(const std::string &key, std::string value, std::uint64_t *written)
+{
+    const std::uint64_t version = next_version();
+    if (!db_.put(key, value, version))
+        return Status::Error;
+    fill(key, VersionedValue{std::move(value), version});
+    if (written)
+        *written = version;
+    for (auto *peer : peers_)
+        peer->remove(key);
+    clear_ttl(key);
+    return Status::Ok;
+}
+
+KVService::Status KVService::erase(const std::string &key)
+{
+    bool existed = false;
+    if (!db_.remove(key, existed))
+        return Status::Error;
+    invalidate(key);
+    return existed ? Status::Ok : Status::NotFound;
+}
+
+bool KVService::offload(std::function<void()> task)
+{
+    if (offload_)
+        return offload_->submit(std::move(task));
+    task();
+    return true;
+}
+
+bool KVService::enter_slow_lane()
+{
+    if (slow_lane_limit_)
+    {
+        if (slow_lane_in_use_.fetch_add(1, std::memory_order_relaxed) >= slow_lane_limit_)
+        {
+            slow_lane_in_use_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    if (admit())
+        return true;
+    if (slow_lane_limit_)
+        slow_lane_in_use_.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+}
+
+void KVService::leave_slow_lane(Clock::time_point started)
+{
+    if (slow_lane_limit_)
+        slow_lane_in_use_.fetch_sub(1, std::memory_order_relaxed);
+    finish(started);
+}
+
+void KVService::leave_slow_lane()
+{
+    if (slow_lane_limit_)
+        slow_lane_in_use_.fetch_sub(1, std::memory_order_relaxed);
+    abandon();
+}
+
+bool KVService::admit()
+{
+    return !admission_ || admission_->try_acquire();
+}
+
+void KVService::finish(Clock::time_point started)
+{
+    if (admission_)
+        admission_->release(Clock::now() - started);
+}
+
+void KVService::abandon()
+{
+    if (admission_)
+        admission_->release();
+}
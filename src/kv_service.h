@@ -0,0 +1,195 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <cstdint>
+#include <functional>
+#include "admission.h"
+#include "expiry_index.h"
+#include "lru_cache.h"
+#include "db_handler.h"
+#include "worker_pool.h"
+#include "versioned_value.h"
+
+// Cache-then-database semantics of the /kv operations, shared by every front end.
+class KVService
+{
+public:
+    enum class Status
+    {
+        Ok,
+        NotFound,
+        Error,
+        Busy,     // the slow lane is full; nothing was attempted
+        Conflict, // compare_and_set: the key has another version
+        Invalid   // increment: the value is not a 64-bit integer, or would overflow
+    };
+
+    // `offload` runs blocking DB calls made through the callback API; nullptr runs
+    // them on the calling thread. It is bypassed when the DB client is async. A
+    // bounded offload pool is the slow lane: when it refuses work the callback
+    // gets Busy.
+    KVService(LRUCache<std::string, VersionedValue> &cache, DBHandler &db, WorkerPool *offload = nullptr);
+
+    // Blocking API, for thread-per-connection front ends. get() also returns the
+    // value's version; remove() returns NotFound when there was no such key.
+    // `entry.gzipped` is set if the value has a compressed form; with `accept_gzip`
+    // a cache hit then leaves `entry.value` empty, otherwise it is always set.
+    // With `size`, a value over the stream threshold is read only up to the
+    // threshold and `*size` is set to its full length, the rest being left to
+    // read_range(); otherwise `*size` is entry.value.size().
+    Status get(const std::string &key, VersionedValue &entry, bool accept_gzip = false, std::uint64_t *size = nullptr);
+    // put() sets `*written` to the new version, if given.
+    Status put(const std::string &key, std::string value, std::uint64_t *written = nullptr);
+    Status remove(const std::string &key);
+
+    // Streaming for values over the stream threshold, which are never cached.
+    // put_stream() writes a value that `produce` passes to its sink in pieces, as a
+    // request body arrives; a false return from `produce` abandons the write. The
+    // pieces are spooled to a temporary file, and only the complete value is sent
+    // to MySQL.
+    // read_range() reads `length` bytes at `offset` of the value get() returned in
+    // part: NotFound if the key has since been deleted or rewritten. It continues a
+    // read already admitted, so it skips the slow lane and admission.
+    Status put_stream(const std::string &key, const std::function<bool(const DBHandler::ChunkSink &)> &produce,
+                      std::uint64_t *written = nullptr);
+    Status read_range(const std::string &key, std::uint64_t version, std::uint64_t offset, std::size_t length,
+                      std::string &out);
+
+    // Server-side read-modify-write, each committed by one conditional statement in
+    // MySQL and then applied to the cache. compare_and_set() writes only if the key
+    // exists with version `expected` (any version when nullopt): NotFound if it does
+    // not exist, Conflict with the current version in `entry` if it differs.
+    // increment() adds `delta` to a base-10 64-bit integer value, a missing key
+    // counting as 0, and returns the new value; if another write gets in between it
+    // re-reads and retries. Both return the new version in `entry`.
+    Status compare_and_set(const std::string &key, std::string value, std::optional<std::uint64_t> expected,
+                           VersionedValue &entry);
+    Status increment(const std::string &key, std::int64_t delta, VersionedValue &entry);
+
+    // Callback API, for event-driven front ends. Cache hits complete on the calling
+    // thread before get() returns; anything that needs MySQL completes later on a
+    // DB loop or offload thread. `entry` holds what get() found, or the version put()
+    // wrote.
+    using Callback = std::function<void(Status status, VersionedValue entry)>;
+    void get(const std::string &key, Callback done, bool accept_gzip = false);
+    void put(const std::string &key, std::string value, Callback done);
+    void remove(const std::string &key, Callback done);
+    void compare_and_set(const std::string &key, std::string value, std::optional<std::uint64_t> expected,
+                         Callback done);
+    void increment(const std::string &key, std::int64_t delta, Callback done);
+
+    // Caps how many callers of the blocking API may be in MySQL at once; the rest get
+    // Busy immediately. Keeps some handler threads free for cache hits. 0 = no cap.
+    void set_slow_lane_limit(std::size_t limit) { slow_lane_limit_ = limit; }
+    // Adaptive limit on DB-bound operations through either API, shared between services
+    // that use the same MySQL. Operations it refuses get Busy. nullptr = no limit.
+    void set_admission(AdmissionController *admission) { admission_ = admission; }
+
+    // Values of at least `min_bytes` are also cached gzip-compressed, once per write or
+    // fill, for readers that pass accept_gzip. 0 = off; always off without zlib.
+    void set_compression(std::size_t min_bytes) { compress_min_bytes_ = min_bytes; }
+    // Values of at least `min_bytes` are held LZ4-compressed in the cache and
+    // decompressed on every hit, so a byte-budgeted cache fits more of them. 0 = off.
+    void set_cache_compression(std::size_t min_bytes) { pack_min_bytes_ = min_bytes; }
+    // Values longer than `bytes` are streamed rather than held whole: see put_stream()
+    // and get(). Every front end leaves them out of the cache. 0 = off.
+    void set_stream_threshold(std::size_t bytes) { stream_threshold_ = bytes; }
+    std::size_t stream_threshold() const { return stream_threshold_; }
+
+    // The cache's counters, and how many values LZ4 packing has compressed and
+    // decompressed and the time it took.
+    struct Stats
+    {
+        LRUCache<std::string, VersionedValue>::Counters cache;
+        std::uint64_t packed;
+        std::uint64_t pack_ns;
+        std::uint64_t unpacked;
+        std::uint64_t unpack_ns;
+    };
+    Stats stats();
+
+    // Deadlines for set_ttl(), shared by every service over the same store. A read
+    // that finds its key past its deadline deletes it and reports NotFound; any
+    // write clears the deadline. nullptr = keys never expire.
+    void set_expiry(ExpiryIndex *expiry) { expiry_ = expiry; }
+    // Expires `key` after `ttl`. Returns false if there is no expiry index.
+    bool set_ttl(const std::string &key, std::chrono::milliseconds ttl);
+    // True if `key` is past its deadline. Point reads act on this themselves; scans
+    // and exports, which read MySQL directly, skip such keys with it.
+    bool expired(const std::string &key) { return expiry_ && expiry_->expired(key); }
+
+    // Caches owned by sibling services (one per listener) that must drop a key
+    // whenever this service writes it.
+    void set_peers(std::vector<LRUCache<std::string, VersionedValue> *> peers) { peers_ = std::move(peers); }
+    // Drops `key` from this cache and every peer's, after a write that bypassed put/remove.
+    void invalidate(const std::string &key);
+
+    LRUCache<std::string, VersionedValue> &cache() { return cache_; }
+    DBHandler &db() { return db_; }
+
+private:
+    using Clock = AdmissionController::Clock;
+
+    // DB operation plus its cache update, with no admission checks.
+    Status fetch(const std::string &key, VersionedValue &entry, std::uint64_t *size = nullptr);
+    Status store(const std::string &key, std::string value, std::uint64_t *written = nullptr);
+    Status erase(const std::string &key);
+    // Conditional operations written against DBHandler's callback calls, which
+    // complete inline unless the DB client is async.
+    void swap_if(const std::string &key, std::string value, std::optional<std::uint64_t> expected, Callback done);
+    void add(const std::string &key, std::int64_t delta, unsigned attempt, Callback done);
+    // Blocking API over one of the above.
+    Status wait_for(const std::function<void(Callback)> &op, VersionedValue &entry);
+    // Callback API over one of the above: admission, then the offload pool unless the DB client is async.
+    void submit(std::function<void(Callback)> op, Callback done);
+    // Caches `entry` unless the cache already holds a newer version.
+    void fill(const std::string &key, VersionedValue entry);
+    // Cache hit for get(): the compressed form instead of the value when the caller
+    // takes it, and the value unpacked otherwise.
+    bool lookup(const std::string &key, VersionedValue &entry, bool accept_gzip);
+    // Sets entry.gzipped if the value is large enough and compresses well.
+    void compress(VersionedValue &entry) const;
+    // Readies an entry for the cache: compress(), then pack() its value.
+    void prepare(VersionedValue &entry);
+    // False for values over the stream threshold, which are not cached.
+    bool cacheable(const VersionedValue &entry) const
+    {
+        return !stream_threshold_ || entry.value.size() <= stream_threshold_;
+    }
+
+    void clear_ttl(const std::string &key)
+    {
+        if (expiry_)
+            expiry_->clear(key);
+    }
+
+    bool offload(std::function<void()> task);
+    // Blocking API: the fixed slow-lane cap, then admission.
+    bool enter_slow_lane();
+    void leave_slow_lane(Clock::time_point started);
+    // Leaves without a latency sample, for operations timed by the client, not MySQL.
+    void leave_slow_lane();
+    // Admission only; finish() reports the operation's latency, abandon() that it never ran.
+    bool admit();
+    void finish(Clock::time_point started);
+    void abandon();
+
+    LRUCache<std::string, VersionedValue> &cache_;
+    DBHandler &db_;
+    WorkerPool *offload_;
+    std::vector<LRUCache<std::string, VersionedValue> *> peers_;
+    AdmissionController *admission_ = nullptr;
+    ExpiryIndex *expiry_ = nullptr;
+    std::size_t slow_lane_limit_ = 0;
+    std::size_t compress_min_bytes_ = 0;
+    std::size_t pack_min_bytes_ = 0;
+    std::size_t stream_threshold_ = 0;
+    std::atomic<std::uint64_t> packed_{0};
+    std::atomic<std::uint64_t> pack_ns_{0};
+    std::atomic<std::uint64_t> unpacked_{0};
+    std::atomic<std::uint64_t> unpack_ns_{0};
+    std::atomic<std::size_t> slow_lane_in_use_{0};
+};
@@ -6,6 +6,15 @@
 #include <random>
 #include <sstream>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <strings.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "httplib.h"
 
 using namespace std::chrono;
@@ -18,12 +27,25 @@ struct Stats
     std::atomic<uint64_t> total_latency_us{0};
 };
 
+// A server_host of "unix:/path" targets the server's --unix-socket instead of TCP;
+// the port is then ignored.
+static bool unix_socket_path(const std::string &host, std::string &path)
+{
+    if (host.compare(0, 5, "unix:") != 0)
+        return false;
+    path = host.substr(5);
+    return true;
+}
+
 void run_client_thread(int id, const std::string &server_host, int server_port,
                        int duration_seconds, double read_ratio,
                        int key_space, Stats &stats, int think_ms)
 {
-
-    httplib::Client cli(server_host.c_str(), server_port);
+    std::string socket_path;
+    const bool use_unix = unix_socket_path(server_host, socket_path);
+    httplib::Client cli(use_unix ? socket_path : server_host, server_port);
+    if (use_unix)
+        cli.set_address_family(AF_UNIX);
     // Set read and write timeouts to 5 seconds to avoid hanging indefinitely
     cli.set_read_timeout(5, 0);
     cli.set_write_timeout(5, 0);
@@ -77,13 +99,193 @@ void run_client_thread(int id, const std::string &server_host, int server_port,
     }
 }
 
+static int connect_to(const std::string &host, int port)
+{
+    timeval timeout{5, 0};
+    std::string path;
+    if (unix_socket_path(host, path))
+    {
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path))
+            return -1;
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        return fd;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+        return -1;
+    int fd = -1;
+    for (addrinfo *ai = result; ai && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd < 0)
+        return -1;
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    // Same 5 second timeout as the httplib client.
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+// Reads one response off `fd`, buffering leftovers in `buf`. Returns the status code, or -1.
+static int read_response(int fd, std::string &buf)
+{
+    std::size_t header_end;
+    while ((header_end = buf.find("\r\n\r\n")) == std::string::npos)
+    {
+        char chunk[16 * 1024];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            return -1;
+        buf.append(chunk, static_cast<std::size_t>(n));
+    }
+    if (buf.compare(0, 9, "HTTP/1.1 ") != 0 && buf.compare(0, 9, "HTTP/1.0 ") != 0)
+        return -1;
+    const int status = std::atoi(buf.c_str() + 9);
+
+    std::size_t content_length = 0;
+    std::size_t pos = buf.find("\r\n") + 2;
+    while (pos < header_end)
+    {
+        std::size_t eol = buf.find("\r\n", pos);
+        if (strncasecmp(buf.c_str() + pos, "Content-Length:", 15) == 0)
+            content_length = std::strtoull(buf.c_str() + pos + 15, nullptr, 10);
+        pos = eol + 2;
+    }
+    const std::size_t total = header_end + 4 + content_length;
+    while (buf.size() < total)
+    {
+        char chunk[16 * 1024];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            return -1;
+        buf.append(chunk, static_cast<std::size_t>(n));
+    }
+    buf.erase(0, total);
+    return status;
+}
+
+// Like run_client_thread, but writes `depth` requests back to back on one connection
+// before reading any response (HTTP/1.1 pipelining). Each request's latency runs from
+// the batch being sent to its own response arriving.
+void run_pipelined_client_thread(int id, const std::string &server_host, int server_port,
+                                 int duration_seconds, double read_ratio,
+                                 int key_space, Stats &stats, int think_ms, int depth)
+{
+    std::mt19937_64 rng(id + std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    std::uniform_int_distribution<int> keydist(1, key_space);
+    std::uniform_real_distribution<double> opdist(0.0, 1.0);
+
+    std::string socket_path;
+    const std::string host_header = unix_socket_path(server_host, socket_path) ? "localhost" : server_host;
+    int fd = -1;
+    std::string buf;
+    auto end_time = steady_clock::now() + seconds(duration_seconds);
+    while (steady_clock::now() < end_time)
+    {
+        if (fd < 0)
+        {
+            fd = connect_to(server_host, server_port);
+            buf.clear();
+            if (fd < 0)
+            {
+                stats.total_requests++;
+                stats.failure++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+        }
+
+        std::string batch;
+        for (int i = 0; i < depth; ++i)
+        {
+            double op = opdist(rng);
+            int k = keydist(rng);
+            std::string key = "key" + std::to_string(k);
+            if (op <= read_ratio)
+            {
+                batch += "GET /kv/" + key + " HTTP/1.1\r\nHost: " + host_header + "\r\n\r\n";
+            }
+            else
+            {
+                std::string value = "value_from_thread_" + std::to_string(id) + "_" + std::to_string(k);
+                std::string body = "key=" + key + "&value=" + value;
+                batch += "POST /kv HTTP/1.1\r\nHost: " + host_header +
+                         "\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: " +
+                         std::to_string(body.size()) + "\r\n\r\n" + body;
+            }
+        }
+
+        auto start = high_resolution_clock::now();
+        bool ok = send(fd, batch.data(), batch.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(batch.size());
+        for (int i = 0; i < depth; ++i)
+        {
+            int status = ok ? read_response(fd, buf) : -1;
+            ok = status > 0;
+            uint64_t lat = duration_cast<microseconds>(high_resolution_clock::now() - start).count();
+            stats.total_requests++;
+            stats.total_latency_us += lat;
+            if (status == 200 || status == 201)
+                stats.success++;
+            else
+                stats.failure++;
+        }
+        if (!ok)
+        {
+            close(fd);
+            fd = -1;
+        }
+
+        if (think_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(think_ms));
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
 int main(int argc, char **argv)
 {
+    // --pipeline=N may appear anywhere; it is taken out before the positional arguments are read.
+    int pipeline_depth = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], "--pipeline=", 11) != 0)
+            continue;
+        pipeline_depth = std::max(1, std::atoi(argv[i] + 11));
+        for (int j = i; j + 1 < argc; ++j)
+            argv[j] = argv[j + 1];
+        --argc;
+        break;
+    }
+
     if (argc < 3)
     {
-        std::cout << "Usage: load_generator <server_host> <server_port> <clients> <duration_seconds> <read_ratio> [key_space] [think_ms] [output_file]\n";
-        std::cout << "       load_generator <server_host> <server_port>  # remaining parameters via stdin\n";
+        std::cout << "Usage: load_generator [--pipeline=N] <server_host> <server_port> <clients> <duration_seconds> <read_ratio> [key_space] [think_ms] [output_file]\n";
+        std::cout << "       load_generator [--pipeline=N] <server_host> <server_port>  # remaining parameters via stdin\n";
+        std::cout << "       server_host may be unix:/path/to/socket to use the server's --unix-socket\n";
         std::cout << "example: ./load_generator 127.0.0.1 8080 50 60 0.9 1000 0\n";
+        std::cout << "--pipeline=N sends N requests per connection before reading the responses\n";
         return 1;
     }
     std::string host = argv[1];
@@ -127,7 +329,11 @@ int main(int argc, char **argv)
     // Launch client threads, passing stats by reference to aggregate results safely
     for (int i = 0; i < clients; ++i)
     {
-        threads.emplace_back(run_client_thread, i, host, port, duration_seconds, read_ratio, key_space, std::ref(stats), think_ms);
+        if (pipeline_depth > 1)
+            threads.emplace_back(run_pipelined_client_thread, i, host, port, duration_seconds, read_ratio, key_space,
+                                 std::ref(stats), think_ms, pipeline_depth);
+        else
+            threads.emplace_back(run_client_thread, i, host, port, duration_seconds, read_ratio, key_space, std::ref(stats), think_ms);
     }
     auto t0 = high_resolution_clock::now();
     for (auto &t : threads)
@@ -146,6 +352,8 @@ int main(int argc, char **argv)
     summary << "RESULTS:\n";
     summary << " Total time (s): " << total_time_s << "\n";
     summary << " Clients: " << clients << "\n";
+    if (pipeline_depth > 1)
+        summary << " Pipeline depth: " << pipeline_depth << "\n";
     summary << " Requests: " << total << "  Success: " << succ << " Fail: " << fail << "\n";
     summary << " Throughput (req/s): " << throughput << "\n";
     summary << " Avg latency (ms): " << avg_latency_ms << "\n";
@@ -3,44 +3,102 @@
 #include <list>
 #include <mutex>
 #include <optional>
+#include <cstddef>
+
+// Bytes an entry counts against LRUCache's byte budget. Nothing by default; value
+// types that should be weighed provide an overload, found by argument-dependent lookup.
+template <typename K, typename V>
+size_t cache_charge(const K &, const V &)
+{
+    return 0;
+}
 
 template <typename K, typename V>
 class LRUCache
 {
 public:
-    LRUCache(size_t capacity) : cap(capacity) {}
+    // Holds at most `capacity` entries and, if `max_bytes` is nonzero, entries whose
+    // cache_charge() adds up to at most `max_bytes`; an entry larger than that alone
+    // is not cached.
+    LRUCache(size_t capacity, size_t max_bytes = 0) : cap(capacity), max_bytes(max_bytes) {}
+
+    struct Counters
+    {
+        size_t entries;
+        size_t bytes;
+        size_t hits;
+        size_t misses;
+    };
 
     bool get(const K &key, V &value)
+    {
+        return visit(key, [&value](const V &cached)
+                     { value = cached; });
+    }
+
+    // Like get(), but calls `read(cached)` under the lock instead of copying the entry.
+    template <typename F>
+    bool visit(const K &key, F read)
     {
         std::lock_guard<std::mutex> lock(mu);
         auto it = map.find(key);
         if (it == map.end())
+        {
+            ++misses;
             return false;
+        }
+        ++hits;
         // move to front
         lst.splice(lst.begin(), lst, it->second);
-        value = it->second->second;
+        read(static_cast<const V &>(it->second->second));
         return true;
     }
 
     void put(const K &key, const V &value)
     {
+        put(key, V(value));
+    }
+
+    void put(const K &key, V &&value)
+    {
+        put_if(key, std::move(value), [](const V &)
+               { return true; });
+    }
+
+    // Like put(), but an entry already cached is replaced only if `replace(cached)`.
+    template <typename Pred>
+    void put_if(const K &key, V &&value, Pred replace)
+    {
+        const size_t charge = cache_charge(key, value);
         std::lock_guard<std::mutex> lock(mu);
         auto it = map.find(key);
         if (it != map.end())
         {
+            if (!replace(static_cast<const V &>(it->second->second)))
+            {
+                lst.splice(lst.begin(), lst, it->second);
+                return;
+            }
+            if (max_bytes && charge > max_bytes)
+            {
+                // Too big to cache; the old value must not stay behind.
+                erase(it);
+                return;
+            }
             // update and move to front
-            it->second->second = value;
+            bytes -= cache_charge(it->first, it->second->second);
+            it->second->second = std::move(value);
+            bytes += charge;
             lst.splice(lst.begin(), lst, it->second);
+            trim();
             return;
         }
-        if (lst.size() >= cap)
-        {
-            auto last = lst.back();
-            map.erase(last.first);
-            lst.pop_back();
-        }
-        lst.emplace_front(key, value);
+        if (max_bytes && charge > max_bytes)
+            return;
+        lst.emplace_front(key, std::move(value));
         map[key] = lst.begin();
+        bytes += charge;
+        trim();
     }
 
     void remove(const K &key)
@@ -49,8 +107,7 @@ public:
         auto it = map.find(key);
         if (it == map.end())
             return;
-        lst.erase(it->second);
-        map.erase(it);
+        erase(it);
     }
 
     size_t size()
@@ -59,9 +116,35 @@ public:
         return lst.size();
     }
 
+    Counters counters()
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        return Counters{lst.size(), bytes, hits, misses};
+    }
+
 private:
+    using Map = std::unordered_map<K, typename std::list<std::pair<K, V>>::iterator>;
+
+    void erase(typename Map::iterator it)
+    {
+        bytes -= cache_charge(it->first, it->second->second);
+        lst.erase(it->second);
+        map.erase(it);
+    }
+
+    // Evicts from the back while over either limit, never the entry just written.
+    void trim()
+    {
+        while (lst.size() > 1 && (lst.size() > cap || (max_bytes && bytes > max_bytes)))
+            erase(map.find(lst.back().first));
+    }
+
     size_t cap;
+    size_t max_bytes;
+    size_t bytes = 0;
+    size_t hits = 0;
+    size_t misses = 0;
     std::list<std::pair<K, V>> lst;
-    std::unordered_map<K, typename std::list<std::pair<K, V>>::iterator> map;
+    Map map;
     std::mutex mu;
 };
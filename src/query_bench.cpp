@@ -0,0 +1,111 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <mysql/mysql.h>
+#include "query_builder.h"
+
+using namespace std::chrono;
+
+// Every operator new in the process, so a loop's allocations can be counted.
+static std::atomic<std::size_t> allocations{0};
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// How DBHandler escaped before QueryBuilder: a 2n+1 scratch vector, then a copy.
+static std::string escape(MYSQL *conn, const std::string &str)
+{
+    std::vector<char> buf(str.size() * 2 + 1);
+    unsigned long len = mysql_real_escape_string(conn, buf.data(), str.c_str(), str.size());
+    return std::string(buf.data(), len);
+}
+
+// The upsert, point read and delete DBHandler sends per request, built with
+// operator+ as it used to be, then with QueryBuilder into one reused buffer.
+// Reports heap allocations and time per query. Needs only libmysqlclient, not a
+// server: escaping uses the handle's default character set.
+//
+// usage: query_bench [iterations] [value_bytes]
+int main(int argc, char **argv)
+{
+    const std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    const std::size_t value_bytes = argc > 2 ? std::stoul(argv[2]) : 100;
+
+    MYSQL *conn = mysql_init(nullptr);
+    if (!conn)
+    {
+        std::cerr << "mysql_init failed\n";
+        return 1;
+    }
+    const std::string key = "user:1234567890";
+    std::string value(value_bytes, 'x');
+    for (std::size_t i = 0; i < value.size(); i += 7)
+        value[i] = "'\"\\\n"[i % 4];
+    const std::uint64_t version = 1700000000123456;
+
+    std::size_t old_bytes = 0;
+    std::size_t before = allocations.load();
+    auto start = steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        std::string put = "INSERT INTO kv_store (k, v, ver) VALUES ('" + escape(conn, key) + "', '" +
+                          escape(conn, value) + "', " + std::to_string(version) +
+                          ") ON DUPLICATE KEY UPDATE v = VALUES(v), ver = VALUES(ver)";
+        std::string get = "SELECT v, ver FROM kv_store WHERE k = '" + escape(conn, key) + "' LIMIT 1";
+        std::string del = "DELETE FROM kv_store WHERE k = '" + escape(conn, key) + "'";
+        old_bytes += put.size() + get.size() + del.size();
+    }
+    const double old_ns = duration<double, std::nano>(steady_clock::now() - start).count() / (iterations * 3);
+    const double old_allocs = double(allocations.load() - before) / (iterations * 3);
+
+    std::string buffer;
+    std::size_t new_bytes = 0;
+    before = allocations.load();
+    start = steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        QueryBuilder put(conn, buffer);
+        put.sql("INSERT INTO kv_store (k, v, ver) VALUES (").quoted(key).sql(", ").quoted(value).sql(", ").number(version);
+        put.sql(") ON DUPLICATE KEY UPDATE v = VALUES(v), ver = VALUES(ver)");
+        new_bytes += put.str().size();
+        QueryBuilder get(conn, buffer);
+        get.sql("SELECT v, ver FROM kv_store WHERE k = ").quoted(key).sql(" LIMIT 1");
+        new_bytes += get.str().size();
+        QueryBuilder del(conn, buffer);
+        del.sql("DELETE FROM kv_store WHERE k = ").quoted(key);
+        new_bytes += del.str().size();
+    }
+    const double new_ns = duration<double, std::nano>(steady_clock::now() - start).count() / (iterations * 3);
+    const std::size_t new_total = allocations.load() - before;
+
+    mysql_close(conn);
+    if (old_bytes != new_bytes)
+    {
+        std::cerr << "Builders disagree: " << old_bytes << " vs " << new_bytes << " bytes\n";
+        return 1;
+    }
+    std::cout << "Iterations: " << iterations << " x 3 queries, " << value_bytes << "-byte value\n"
+              << " operator+:     " << old_allocs << " allocations, " << old_ns << " ns per query\n"
+              << " QueryBuilder:  " << double(new_total) / (iterations * 3) << " allocations (" << new_total
+              << " in all, while the buffer grew), " << new_ns << " ns per query\n";
+    return 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <cstdint>
+#include <cstddef>
+#include <mysql/mysql.h>
+
+// Largest query buffer a connection keeps between queries; one grown past this by a
+// large value is freed rather than held for good.
+static const std::size_t kMaxRetainedQueryBytes = 1024 * 1024;
+
+// Builds an SQL statement in a caller-owned buffer, escaping string literals
+// straight into place with mysql_real_escape_string. Given a buffer reused across
+// queries, as each pooled connection keeps one, building allocates only when a
+// statement is longer than any built in that buffer before.
+class QueryBuilder
+{
+public:
+    QueryBuilder(MYSQL *conn, std::string &buffer) : conn_(conn), buf_(buffer) { buf_.clear(); }
+
+    // SQL text, appended as is.
+    QueryBuilder &sql(std::string_view text)
+    {
+        buf_.append(text.data(), text.size());
+        return *this;
+    }
+
+    // A quoted string literal.
+    QueryBuilder &quoted(std::string_view value)
+    {
+        buf_ += '\'';
+        escape(value);
+        buf_ += '\'';
+        return *this;
+    }
+
+    // A quoted LIKE pattern matching every string that starts with `prefix`. Runs
+    // between the LIKE wildcards are escaped as usual; each wildcard, or backslash,
+    // gets a backslash, itself doubled inside the literal.
+    QueryBuilder &prefix_pattern(std::string_view prefix)
+    {
+        buf_ += '\'';
+        std::size_t start = 0;
+        for (std::size_t i = 0; i < prefix.size(); ++i)
+        {
+            const char c = prefix[i];
+            if (c != '%' && c != '_' && c != '\\')
+                continue;
+            escape(prefix.substr(start, i - start));
+            buf_ += "\\\\";
+            if (c == '\\')
+                buf_ += "\\\\";
+            else
+                buf_ += c;
+            start = i + 1;
+        }
+        escape(prefix.substr(start));
+        buf_ += "%'";
+        return *this;
+    }
+
+    QueryBuilder &number(std::uint64_t n)
+    {
+        char digits[20];
+        auto result = std::to_chars(digits, digits + sizeof(digits), n);
+        buf_.append(digits, static_cast<std::size_t>(result.ptr - digits));
+        return *this;
+    }
+
+    const std::string &str() const { return buf_; }
+
+private:
+    void escape(std::string_view text)
+    {
+        // Worst case every byte is escaped, plus the terminating NUL the client writes.
+        const std::size_t at = buf_.size();
+        buf_.resize(at + text.size() * 2 + 1);
+        const unsigned long len = mysql_real_escape_string(conn_, &buf_[at], text.data(), text.size());
+        buf_.resize(at + len);
+    }
+
+    MYSQL *conn_;
+    std::string &buf_;
+};
@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstddef>
+
+// Remembers keys written in the last `window`. Reads of those keys must not go to
+// a replica that may not have applied the write yet. Striped by key hash so
+// writers on different keys rarely share a lock.
+class RecentWrites
+{
+public:
+    explicit RecentWrites(std::chrono::milliseconds window) : window_(window) {}
+
+    void note(const std::string &key)
+    {
+        Stripe &stripe = stripe_for(key);
+        const auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(stripe.mu);
+        stripe.expiry[key] = now + window_;
+        if (stripe.expiry.size() >= stripe.sweep_at)
+        {
+            for (auto it = stripe.expiry.begin(); it != stripe.expiry.end();)
+            {
+                if (it->second <= now)
+                    it = stripe.expiry.erase(it);
+                else
+                    ++it;
+            }
+            // Amortize sweeps: the next one runs once the live set has doubled.
+            stripe.sweep_at = std::max<std::size_t>(kMinSweep, stripe.expiry.size() * 2);
+        }
+    }
+
+    bool contains(const std::string &key)
+    {
+        Stripe &stripe = stripe_for(key);
+        std::lock_guard<std::mutex> lock(stripe.mu);
+        auto it = stripe.expiry.find(key);
+        return it != stripe.expiry.end() && it->second > std::chrono::steady_clock::now();
+    }
+
+private:
+    static constexpr std::size_t kStripes = 16;
+    static constexpr std::size_t kMinSweep = 1024;
+
+    struct Stripe
+    {
+        std::mutex mu;
+        std::unordered_map<std::string, std::chrono::steady_clock::time_point> expiry;
+        std::size_t sweep_at = kMinSweep;
+    };
+
+    Stripe &stripe_for(const std::string &key)
+    {
+        return stripes_[std::hash<std::string>{}(key) % kStripes];
+    }
+
+    std::chrono::milliseconds window_;
+    Stripe stripes_[kStripes];
+};
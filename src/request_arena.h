@@ -0,0 +1,156 @@
+#pragma once
+#include <memory_resource>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// First block of each thread's arena, and the most it keeps between requests: a
+// request that needed more, such as a huge value's compression scratch, gives the
+// extra blocks back rather than pinning them to the thread.
+static const std::size_t kArenaFirstBlockBytes = 64 * 1024;
+static const std::size_t kArenaRetainedBytes = 4 * 1024 * 1024;
+
+// Monotonic memory for a request's scratch: compression buffers, zlib's state,
+// upload pieces on their way to MySQL. Allocation bumps a pointer through blocks
+// that are kept across requests; deallocation does nothing; reset() rewinds the
+// lot at once. One per thread (see request_arena::local()), so no locking.
+class RequestArena : public std::pmr::memory_resource
+{
+public:
+    RequestArena() = default;
+    RequestArena(const RequestArena &) = delete;
+    RequestArena &operator=(const RequestArena &) = delete;
+
+    // Rewinds to the first block, freeing blocks beyond the retained size.
+    void reset()
+    {
+        std::size_t kept = 0;
+        std::size_t n = 0;
+        while (n < blocks_.size() && kept + blocks_[n].size <= kArenaRetainedBytes)
+            kept += blocks_[n++].size;
+        blocks_.erase(blocks_.begin() + n, blocks_.end());
+        current_ = 0;
+        used_ = 0;
+    }
+
+    // Bytes held in blocks, whether in use or not.
+    std::size_t capacity() const
+    {
+        std::size_t total = 0;
+        for (const auto &block : blocks_)
+            total += block.size;
+        return total;
+    }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<std::max_align_t[]> data;
+        std::size_t size;
+    };
+
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if (alignment > alignof(std::max_align_t))
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        while (true)
+        {
+            if (current_ < blocks_.size())
+            {
+                const Block &block = blocks_[current_];
+                const std::size_t start = (used_ + alignment - 1) & ~(alignment - 1);
+                if (start + bytes <= block.size)
+                {
+                    used_ = start + bytes;
+                    return reinterpret_cast<char *>(block.data.get()) + start;
+                }
+                if (current_ + 1 < blocks_.size())
+                {
+                    ++current_;
+                    used_ = 0;
+                    continue;
+                }
+            }
+            // Each new block at least doubles the last, so a request settles into a
+            // few blocks that the next one reuses.
+            const std::size_t last = blocks_.empty() ? kArenaFirstBlockBytes / 2 : blocks_.back().size;
+            const std::size_t size = std::max(last * 2, bytes + alignof(std::max_align_t));
+            const std::size_t words = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+            blocks_.push_back(Block{std::unique_ptr<std::max_align_t[]>(new std::max_align_t[words]),
+                                    words * sizeof(std::max_align_t)});
+            current_ = blocks_.size() - 1;
+            used_ = 0;
+        }
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+    {
+        if (alignment > alignof(std::max_align_t))
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+    std::vector<Block> blocks_;
+    std::size_t current_ = 0;
+    std::size_t used_ = 0;
+};
+
+namespace request_arena
+{
+    inline RequestArena &local()
+    {
+        static thread_local RequestArena arena;
+        return arena;
+    }
+
+    inline std::size_t &depth()
+    {
+        static thread_local std::size_t open = 0;
+        return open;
+    }
+
+    // Marks a request, or a piece of one run on another thread, such as a fill on
+    // a DB loop. Scopes nest; the outermost rewinds the thread's arena when it ends,
+    // so nothing allocated from it may outlive that.
+    class Scope
+    {
+    public:
+        Scope() { ++depth(); }
+        ~Scope()
+        {
+            if (--depth() == 0)
+                local().reset();
+        }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
+
+    // Where a temporary should come from: the thread's arena inside a Scope, the
+    // heap outside one, where nothing would ever rewind the arena.
+    inline std::pmr::memory_resource *resource()
+    {
+        return depth() ? static_cast<std::pmr::memory_resource *>(&local()) : std::pmr::new_delete_resource();
+    }
+
+    // An uninitialized scratch buffer from resource(), given back when destroyed.
+    class Buffer
+    {
+    public:
+        explicit Buffer(std::size_t size)
+            : resource_(resource()), data_(static_cast<char *>(resource_->allocate(size, 1))), size_(size) {}
+        ~Buffer() { resource_->deallocate(data_, size_, 1); }
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+
+        char *data() const { return data_; }
+        std::size_t size() const { return size_; }
+
+    private:
+        std::pmr::memory_resource *resource_;
+        char *data_;
+        std::size_t size_;
+    };
+}
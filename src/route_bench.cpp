@@ -0,0 +1,64 @@
+#include <iostream>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include "kv_route.h"
+
+using namespace std::chrono;
+
+// Compares the per-request cost of matching "/kv/<key>" with the std::regex the
+// routes used to be registered with (matched the way httplib's RegexMatcher does)
+// against kv_route::match_key.
+//
+// usage: route_bench [iterations]
+int main(int argc, char **argv)
+{
+    const std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 2000000;
+    const std::vector<std::string> paths = {
+        "/kv/key42",
+        "/kv/user_1234567890",
+        "/kv/session-8f14e45fceea167a5a36dedd4bea2543",
+        "/kv/bad key",
+        "/export",
+    };
+
+    const std::regex re(R"(/kv/([\w\-%\.]+))");
+    std::size_t regex_hits = 0;
+    auto start = steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        const std::string &path = paths[i % paths.size()];
+        std::smatch matches;
+        if (std::regex_match(path, matches, re))
+        {
+            std::string key = matches[1];
+            regex_hits += key.size();
+        }
+    }
+    const double regex_ns = duration<double, std::nano>(steady_clock::now() - start).count() / iterations;
+
+    std::size_t match_hits = 0;
+    start = steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        const std::string &path = paths[i % paths.size()];
+        std::string_view key;
+        if (kv_route::match_key(path, key))
+            match_hits += key.size();
+    }
+    const double match_ns = duration<double, std::nano>(steady_clock::now() - start).count() / iterations;
+
+    if (regex_hits != match_hits)
+    {
+        std::cerr << "Matchers disagree: regex " << regex_hits << " vs kv_route " << match_hits << "\n";
+        return 1;
+    }
+    std::cout << "Iterations: " << iterations << "\n"
+              << " std::regex_match:     " << regex_ns << " ns/request\n"
+              << " kv_route::match_key:  " << match_ns << " ns/request\n"
+              << " Saving:               " << regex_ns - match_ns << " ns/request ("
+              << regex_ns / match_ns << "x)\n";
+    return 0;
+}
@@ -1,22 +1,339 @@
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <charconv>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include "lru_cache.h"
 #include "db_handler.h"
+#include "dump_format.h"
+#include "kv_service.h"
+#include "worker_pool.h"
+#include "event_server.h"
+#include "kv_route.h"
+#include "etag.h"
+#include "gzip.h"
+#include "request_arena.h"
+#include "work_stealing_queue.h"
 #include "httplib.h"
 
-int main(int argc, char **argv)
+// Default entry cap of the LRU cache; --cache-mb adds a byte budget on top.
+static const std::size_t kCacheCapacity = 1000;
+
+// Values are opaque bytes.
+static const char *const kValueContentType = "application/octet-stream";
+
+// Seconds a client is told to back off after a 503.
+static const char *const kRetryAfterSeconds = "1";
+
+// Rows fetched from MySQL per chunk of a /kv scan, and the number of rows returned when no limit is given.
+static const std::size_t kScanPageSize = 256;
+static const std::size_t kScanDefaultLimit = 1000;
+
+// Default --stream-threshold, and the bytes of a streamed value read from MySQL per
+// query while it is sent.
+static const std::size_t kStreamThreshold = 1024 * 1024;
+static const std::size_t kStreamChunkBytes = 256 * 1024;
+
+// Bytes of dump buffered before each chunk is written out by /export.
+static const std::size_t kExportFlushBytes = 64 * 1024;
+
+// /import flushes a multi-row INSERT at whichever limit is reached first; the byte
+// limit keeps each statement well under MySQL's max_allowed_packet.
+static const std::size_t kImportBatchRows = 1000;
+static const std::size_t kImportBatchBytes = 4 * 1024 * 1024;
+
+// Collects "--name=value" arguments; a bare "--name" maps to "1".
+static std::map<std::string, std::string> parse_flags(int argc, char **argv)
 {
-    // MySQL config
-    std::string db_host = "127.0.0.1";
-    std::string db_user = "kvuser";
-    std::string db_pass = "kvpass";
-    std::string db_name = "kvdb";
-    unsigned int db_port = 3306;
+    std::map<std::string, std::string> flags;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+        {
+            std::cerr << "Ignoring unexpected argument: " << arg << "\n";
+            continue;
+        }
+        auto eq = arg.find('=');
+        if (eq == std::string::npos)
+            flags[arg.substr(2)] = "1";
+        else
+            flags[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+    return flags;
+}
 
-    DBHandler db(db_host, db_user, db_pass, db_name, db_port);
-    LRUCache<std::string, std::string> cache(1000);
+static DBHandler::Backend parse_endpoint(const std::string &item)
+{
+    DBHandler::Backend backend;
+    auto colon = item.rfind(':');
+    backend.host = item.substr(0, colon);
+    if (colon != std::string::npos)
+        backend.port = static_cast<unsigned int>(std::stoul(item.substr(colon + 1)));
+    return backend;
+}
 
-    httplib::Server svr;
+// Parses "primary[/replica...],primary[/replica...],..." into MySQL backends,
+// where each endpoint is "host[:port]".
+static std::vector<DBHandler::Backend> parse_backends(const std::string &spec)
+{
+    std::vector<DBHandler::Backend> backends;
+    std::size_t start = 0;
+    while (start <= spec.size())
+    {
+        std::size_t end = spec.find(',', start);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string item = spec.substr(start, end - start);
+        if (!item.empty())
+        {
+            auto slash = item.find('/');
+            DBHandler::Backend backend = parse_endpoint(item.substr(0, slash));
+            while (slash != std::string::npos)
+            {
+                auto next = item.find('/', slash + 1);
+                backend.replicas.push_back(parse_endpoint(item.substr(slash + 1, next == std::string::npos ? std::string::npos : next - slash - 1)));
+                slash = next;
+            }
+            backends.push_back(backend);
+        }
+        start = end + 1;
+    }
+    return backends;
+}
+
+// Pins the calling thread to `core`; threads it starts afterwards inherit the mask.
+static void pin_to_core(unsigned core)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0)
+        std::cerr << "Cannot pin listener to core " << core << ": " << std::strerror(rc) << "\n";
+}
+
+// Task queue behind an httplib server: httplib's own ThreadPool, or per-worker lanes with stealing.
+static std::function<httplib::TaskQueue *()> task_queue_factory(const std::string &kind, std::size_t threads)
+{
+    if (kind == "stealing")
+        return [threads]
+        { return new WorkStealingQueue(threads); };
+    return [threads]
+    { return new httplib::ThreadPool(threads); };
+}
+
+// Response for a request shed because the DB-bound lane is full.
+static void set_busy(httplib::Response &res)
+{
+    res.status = 503;
+    res.set_header("Retry-After", kRetryAfterSeconds);
+    res.set_content("Server busy", "text/plain");
+}
+
+// Whether a GET is answered with just the byte ranges it asked for: it has a Range
+// header, and any If-Range names the current version.
+static bool partial_content(const httplib::Request &req, std::uint64_t version)
+{
+    return !req.ranges.empty() && (!req.has_header("If-Range") || req.get_header_value("If-Range") == etag::format(version));
+}
+
+// Registers every route on `svr`, served through `service`.
+static void add_routes(httplib::Server &svr, KVService &service)
+{
+    DBHandler &db = service.db();
+
+    // GET /kv/<key> and DELETE /kv/<key> are the hot path, so they are matched by
+    // kv_route before httplib's router, which would run a std::regex per request.
+    // Requests with a body, such as PUT, fall through to the router.
+    svr.set_pre_routing_handler([&service](const httplib::Request &req, httplib::Response &res)
+                                {
+        std::string_view key_view;
+        if (!kv_route::match_key(req.path, key_view) || req.has_header("Transfer-Encoding") ||
+            req.get_header_value_u64("Content-Length") > 0)
+            return httplib::Server::HandlerResponse::Unhandled;
+        // Temporaries of the request, such as compression scratch on a fill, come
+        // from this thread's arena and are dropped together when it is answered.
+        request_arena::Scope scope;
+        const std::string key(key_view);
+
+        if (req.method == "GET") {
+            // Byte ranges are served from the value as stored, never the gzip form.
+            const bool ranged = !req.ranges.empty();
+            const bool accept_gzip = !ranged && gzip::accepted(req.get_header_value("Accept-Encoding"));
+            VersionedValue entry;
+            std::uint64_t size = 0;
+            KVService::Status status = service.get(key, entry, accept_gzip, &size);
+            if (status == KVService::Status::Ok) {
+                // A client that already holds this version gets no body back. The
+                // gzip form is tagged apart from the value as stored, which is the
+                // only form byte ranges and If-Range apply to.
+                const bool send_gzip = entry.gzipped && accept_gzip;
+                res.set_header("ETag", etag::format(entry.version, send_gzip));
+                res.set_header("Accept-Ranges", "bytes");
+                if (entry.gzipped)
+                    res.set_header("Vary", "Accept-Encoding");
+                if (etag::none_match_hits(req.get_header_value("If-None-Match"), entry.version)) {
+                    res.status = 304;
+                } else if (send_gzip) {
+                    // Written straight from the cached buffer, which the provider keeps alive.
+                    res.status = 200;
+                    res.set_header("Content-Encoding", "gzip");
+                    std::shared_ptr<const std::string> body = std::move(entry.gzipped);
+                    res.set_content_provider(body->size(), kValueContentType,
+                                             [body](size_t offset, size_t length, httplib::DataSink &sink)
+                                             { return sink.write(body->data() + offset, length); });
+                } else if (size > entry.value.size()) {
+                    // Too large to have been read whole: the first part came with the
+                    // lookup, and the rest is read page by page as the client takes it.
+                    // httplib calls the provider for just the requested ranges.
+                    res.status = partial_content(req, entry.version) ? 206 : 200;
+                    auto head = std::make_shared<std::string>(std::move(entry.value));
+                    auto page = std::make_shared<std::string>();
+                    res.set_content_provider(size, kValueContentType,
+                                             [&service, key, version = entry.version, head, page](size_t offset, size_t length, httplib::DataSink &sink)
+                                             {
+                        if (offset < head->size())
+                            return sink.write(head->data() + offset, std::min(length, head->size() - offset));
+                        // A value rewritten or deleted meanwhile ends the response short.
+                        const std::size_t want = std::min(length, kStreamChunkBytes);
+                        return service.read_range(key, version, offset, want, *page) == KVService::Status::Ok &&
+                               page->size() == want && sink.write(page->data(), page->size()); });
+                } else {
+                    res.status = partial_content(req, entry.version) ? 206 : 200;
+                    res.set_content(std::move(entry.value), kValueContentType);
+                }
+            } else if (status == KVService::Status::Busy) {
+                set_busy(res);
+            } else if (status == KVService::Status::NotFound) {
+                res.status = 404;
+                res.set_content("Not found", "text/plain");
+            } else {
+                res.status = 500;
+                res.set_content("DB error", "text/plain");
+            }
+            return httplib::Server::HandlerResponse::Handled;
+        }
+
+        if (req.method == "DELETE") {
+            // Deleting a missing key succeeds, as it always has.
+            KVService::Status status = service.remove(key);
+            if (status == KVService::Status::Ok || status == KVService::Status::NotFound) {
+                res.status = 200;
+                res.set_content("Deleted", "text/plain");
+            } else if (status == KVService::Status::Busy) {
+                set_busy(res);
+            } else {
+                res.status = 500;
+                res.set_content("Delete failed", "text/plain");
+            }
+            return httplib::Server::HandlerResponse::Handled;
+        }
+        return httplib::Server::HandlerResponse::Unhandled; });
+
+    // PUT /kv/<key> with the raw body as the value. The body is read straight into
+    // the string that ends up in the cache, with no form decoding or extra copy.
+    // "/kv/:key" uses httplib's path-param matcher rather than a regex. With If-Match
+    // it is a compare-and-set against the tag's version. Bodies over the stream
+    // threshold, or of unknown length, are spooled to disk and then sent to MySQL
+    // piece by piece, unless they carry If-Match.
+    svr.Put("/kv/:key", [&](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader)
+            {
+        request_arena::Scope scope;
+        const std::string &key = req.path_params.at("key");
+        if (!kv_route::valid_key(key)) {
+            res.status = 404;
+            res.set_content("Not found", "text/plain");
+            return;
+        }
+
+        const std::size_t threshold = service.stream_threshold();
+        const bool streamed = threshold && !req.has_header("If-Match") &&
+                              (req.has_header("Transfer-Encoding") || req.get_header_value_u64("Content-Length") > threshold);
+        std::string value;
+        if (!streamed) {
+            value.reserve(req.get_header_value_u64("Content-Length"));
+            content_reader([&](const char *data, std::size_t len)
+                           {
+                value.append(data, len);
+                return true; });
+        }
+
+        std::uint64_t version = 0;
+        KVService::Status status;
+        if (streamed) {
+            status = service.put_stream(key, [&content_reader](const DBHandler::ChunkSink &sink)
+                                        { return content_reader(sink); }, &version);
+        } else if (req.has_header("If-Match")) {
+            std::optional<std::uint64_t> expected;
+            VersionedValue written;
+            status = etag::parse_if_match(req.get_header_value("If-Match"), expected)
+                         ? service.compare_and_set(key, std::move(value), expected, written)
+                         : KVService::Status::Conflict;
+            version = written.version;
+        } else {
+            status = service.put(key, std::move(value), &version);
+        }
+        if (status == KVService::Status::Ok) {
+            res.status = 201;
+            res.set_header("ETag", etag::format(version));
+            res.set_content("OK", "text/plain");
+        } else if (status == KVService::Status::NotFound || status == KVService::Status::Conflict) {
+            res.status = 412;
+            res.set_content("Precondition failed", "text/plain");
+        } else if (status == KVService::Status::Busy) {
+            set_busy(res);
+        } else {
+            res.status = 500;
+            res.set_content("DB error", "text/plain");
+        } });
+
+    // POST /kv/<key>/incr?by=<n> adds n (default 1, may be negative) to an integer
+    // value, creating it from 0, and returns the result.
+    svr.Post("/kv/:key/incr", [&](const httplib::Request &req, httplib::Response &res)
+             {
+        const std::string &key = req.path_params.at("key");
+        if (!kv_route::valid_key(key)) {
+            res.status = 404;
+            res.set_content("Not found", "text/plain");
+            return;
+        }
+        std::int64_t delta = 1;
+        if (req.has_param("by")) {
+            const std::string by = req.get_param_value("by");
+            auto parsed = std::from_chars(by.data(), by.data() + by.size(), delta);
+            if (by.empty() || parsed.ec != std::errc() || parsed.ptr != by.data() + by.size()) {
+                res.status = 400;
+                res.set_content("Bad request: invalid by", "text/plain");
+                return;
+            }
+        }
+
+        VersionedValue entry;
+        KVService::Status status = service.increment(key, delta, entry);
+        if (status == KVService::Status::Ok) {
+            res.status = 200;
+            res.set_header("ETag", etag::format(entry.version));
+            res.set_content(std::move(entry.value), "text/plain");
+        } else if (status == KVService::Status::Invalid) {
+            res.status = 409;
+            res.set_content("Value is not an integer or would overflow", "text/plain");
+        } else if (status == KVService::Status::Busy) {
+            set_busy(res);
+        } else {
+            res.status = 500;
+            res.set_content("DB error", "text/plain");
+        } });
 
     // POST /kv
     svr.Post("/kv", [&](const httplib::Request &req, httplib::Response &res)
@@ -26,58 +343,492 @@ int main(int argc, char **argv)
             res.set_content("Bad request: missing key/value", "text/plain");
             return;
         }
-        
-        std::string key = req.get_param_value("key");
+
+        request_arena::Scope scope;
+        // The key is only read; the value is copied once, into what gets cached.
+        const std::string &key = req.params.find("key")->second;
         std::string value = req.get_param_value("value");
-        
-        if (db.put(key, value)) {
-            cache.put(key, value);
+
+        KVService::Status status = service.put(key, std::move(value));
+        if (status == KVService::Status::Ok) {
             res.status = 201;
             res.set_content("OK", "text/plain");
+        } else if (status == KVService::Status::Busy) {
+            set_busy(res);
         } else {
             res.status = 500;
             res.set_content("DB error", "text/plain");
         } });
 
-    // GET /kv/<key>
-    svr.Get(R"(/kv/([\w\-%\.]+))", [&](const httplib::Request &req, httplib::Response &res)
+    // GET /kv?prefix=<p>&start=<cursor>&limit=<n>
+    // Streams matching pairs in key order, one "key=value" line each (both form-encoded).
+    // Results come straight from MySQL page by page and never touch the cache.
+    svr.Get("/kv", [&](const httplib::Request &req, httplib::Response &res)
             {
-        std::string key = req.matches[1];
-        std::string val;
-        
-        // Try cache first
-        if (cache.get(key, val)) {
-            res.status = 200;
-            res.set_content(val, "text/plain");
-            return;
+        struct ScanState {
+            std::string prefix;
+            std::string cursor;
+            std::size_t remaining;
+        };
+        auto state = std::make_shared<ScanState>();
+        state->prefix = req.get_param_value("prefix");
+        state->cursor = req.get_param_value("start");
+        state->remaining = kScanDefaultLimit;
+        if (req.has_param("limit")) {
+            try {
+                state->remaining = std::stoul(req.get_param_value("limit"));
+            } catch (const std::exception &) {
+                res.status = 400;
+                res.set_content("Bad request: invalid limit", "text/plain");
+                return;
+            }
         }
 
-        // Fetch from DB
-        auto opt = db.get(key);
-        if (opt.has_value()) {
-            cache.put(key, opt.value());
-            res.status = 200;
-            res.set_content(opt.value(), "text/plain");
-        } else {
-            res.status = 404;
-            res.set_content("Not found", "text/plain");
-        } });
+        res.status = 200;
+        res.set_chunked_content_provider("text/plain", [&db, &service, state](std::size_t, httplib::DataSink &sink)
+                                         {
+            if (state->remaining == 0) {
+                sink.done();
+                return true;
+            }
 
-    // DELETE /kv/<key>
-    svr.Delete(R"(/kv/([\w\-%\.]+))", [&](const httplib::Request &req, httplib::Response &res)
-               {
-        std::string key = req.matches[1];
-        
-        if (db.remove(key)) {
-            cache.remove(key);
-            res.status = 200;
-            res.set_content("Deleted", "text/plain");
-        } else {
+            const std::size_t page_size = std::min(state->remaining, kScanPageSize);
+            auto rows = db.scan(state->prefix, state->cursor, page_size);
+            if (!rows.has_value())
+                return false;
+
+            // Keys past their TTL are skipped, as a point read would report them
+            // missing; they still advance the cursor.
+            std::string chunk;
+            std::size_t listed = 0;
+            for (const auto &row : *rows) {
+                if (service.expired(row.first))
+                    continue;
+                ++listed;
+                chunk += httplib::encode_query_component(row.first);
+                chunk += '=';
+                chunk += httplib::encode_query_component(row.second);
+                chunk += '\n';
+            }
+            if (!rows->empty())
+                state->cursor = rows->back().first;
+            state->remaining = rows->size() < page_size ? 0 : state->remaining - listed;
+
+            if (!chunk.empty() && !sink.write(chunk.data(), chunk.size()))
+                return false;
+            if (state->remaining == 0)
+                sink.done();
+            return true; }); });
+
+    // GET /export
+    // Streams the whole store in the binary format of dump_format.h, in key order.
+    svr.Get("/export", [&](const httplib::Request &, httplib::Response &res)
+            {
+        res.status = 200;
+        res.set_chunked_content_provider("application/octet-stream", [&db, &service](std::size_t, httplib::DataSink &sink)
+                                         {
+            std::string buf(dump::kMagic, dump::kMagicSize);
+            buf.reserve(kExportFlushBytes * 2);
+            bool ok = db.export_all([&](const char *key, std::size_t key_len, const char *value, std::size_t value_len)
+                                    {
+                // Expired keys are left out of the dump.
+                if (service.expired(std::string(key, key_len)))
+                    return true;
+                dump::append_record(buf, key, key_len, value, value_len);
+                if (buf.size() < kExportFlushBytes)
+                    return true;
+                bool written = sink.write(buf.data(), buf.size());
+                buf.clear();
+                return written; });
+            if (!ok)
+                return false;
+
+            dump::append_end(buf);
+            if (!sink.write(buf.data(), buf.size()))
+                return false;
+            sink.done();
+            return true; }); });
+
+    // POST /import
+    // Loads a dump produced by GET /export, upserting in multi-row batches as the body arrives.
+    svr.Post("/import", [&](const httplib::Request &, httplib::Response &res, const httplib::ContentReader &content_reader)
+             {
+        dump::Reader reader;
+        std::vector<DBHandler::KVPair> batch;
+        std::size_t batch_bytes = 0;
+        std::size_t imported = 0;
+        bool db_ok = true;
+
+        auto flush = [&]() {
+            if (!db.put_batch(batch))
+                return false;
+            for (const auto &kv : batch)
+                service.invalidate(kv.first);
+            imported += batch.size();
+            batch.clear();
+            batch_bytes = 0;
+            return true;
+        };
+
+        bool parsed = content_reader([&](const char *data, std::size_t len)
+                                     { return reader.feed(data, len, [&](const char *key, std::size_t key_len, const char *value, std::size_t value_len)
+                                                          {
+                batch.emplace_back(std::string(key, key_len), std::string(value, value_len));
+                batch_bytes += key_len + value_len;
+                if (batch.size() >= kImportBatchRows || batch_bytes >= kImportBatchBytes)
+                    db_ok = flush();
+                return db_ok; }); });
+
+        if (db_ok && parsed && reader.finished())
+            db_ok = flush();
+
+        if (!db_ok) {
             res.status = 500;
-            res.set_content("Delete failed", "text/plain");
+            res.set_content("DB error after " + std::to_string(imported) + " pairs", "text/plain");
+        } else if (!parsed || !reader.finished()) {
+            res.status = 400;
+            res.set_content("Bad request: malformed dump after " + std::to_string(imported) + " pairs", "text/plain");
+        } else {
+            res.status = 200;
+            res.set_content("Imported " + std::to_string(imported) + " pairs", "text/plain");
         } });
 
-    std::cout << "Starting server at 0.0.0.0:8080\n";
-    svr.listen("0.0.0.0", 8080);
+    // GET /stats
+    // Cache occupancy and hit counts, and the CPU time spent on LZ4 cache compression, one
+    // "name value" pair per line.
+    svr.Get("/stats", [&](const httplib::Request &, httplib::Response &res)
+            {
+        const KVService::Stats stats = service.stats();
+        const std::size_t lookups = stats.cache.hits + stats.cache.misses;
+        std::string out;
+        auto line = [&out](const char *name, const std::string &value) {
+            out += name;
+            out += ' ';
+            out += value;
+            out += '\n';
+        };
+        line("cache_entries", std::to_string(stats.cache.entries));
+        line("cache_bytes", std::to_string(stats.cache.bytes));
+        line("cache_hits", std::to_string(stats.cache.hits));
+        line("cache_misses", std::to_string(stats.cache.misses));
+        line("cache_hit_rate", lookups ? std::to_string(double(stats.cache.hits) / lookups) : "0");
+        line("lz4_packed", std::to_string(stats.packed));
+        line("lz4_pack_us", std::to_string(stats.pack_ns / 1000));
+        line("lz4_unpacked", std::to_string(stats.unpacked));
+        line("lz4_unpack_us", std::to_string(stats.unpack_ns / 1000));
+        res.status = 200;
+        res.set_content(out, "text/plain"); });
+}
+
+int main(int argc, char **argv)
+{
+    auto flags = parse_flags(argc, argv);
+    auto flag = [&flags](const std::string &name, const std::string &fallback)
+    {
+        auto it = flags.find(name);
+        return it == flags.end() ? fallback : it->second;
+    };
+
+    // MySQL config
+    std::string db_user = "kvuser";
+    std::string db_pass = "kvpass";
+    std::string db_name = "kvdb";
+    // One or more instances; keys are spread across them by consistent hashing.
+    std::vector<DBHandler::Backend> db_backends = parse_backends(flag("db", "127.0.0.1:3306"));
+    std::size_t db_pool_size = std::stoul(flag("db-pool", "8"));
+    // How long after a write its key is read from the primary rather than a replica.
+    std::chrono::milliseconds read_your_writes(std::stoul(flag("replica-lag-ms", "1000")));
+
+    if (db_backends.empty())
+    {
+        std::cerr << "--db needs at least one host[:port]\n";
+        return 1;
+    }
+
+    DBHandler db(db_backends, db_user, db_pass, db_name, db_pool_size, read_your_writes);
+    std::cout << "Using " << db.shard_count() << " MySQL backend(s)\n";
+
+    // Non-blocking MySQL client for the callback (get_async/put_async/remove_async) paths.
+    if (flags.count("async-db"))
+    {
+        std::size_t async_conns = std::stoul(flag("async-db-conns", "32"));
+        std::size_t async_loops = std::stoul(flag("async-db-loops", "2"));
+        if (db.enable_async(async_conns, async_loops))
+            std::cout << "Async DB client: " << async_loops << " loop(s) x " << async_conns << " connection(s) per instance\n";
+        else
+            std::cerr << "Async DB client unavailable; using the blocking pools\n";
+    }
+    // At most --cache-entries values and, with --cache-mb, that many MiB of them.
+    const std::size_t cache_entries = std::stoul(flag("cache-entries", std::to_string(kCacheCapacity)));
+    const std::size_t cache_bytes = std::stoul(flag("cache-mb", "0")) * 1024 * 1024;
+    LRUCache<std::string, VersionedValue> cache(cache_entries, cache_bytes);
+
+    // "httplib" serves every route thread-per-connection; "epoll" serves the point /kv
+    // routes from event loops and leaves the bulk routes to httplib on --admin-port.
+    const std::string frontend = flag("frontend", "httplib");
+    const int port = std::stoi(flag("port", "8080"));
+    if (frontend != "httplib" && frontend != "epoll")
+    {
+        std::cerr << "--frontend must be httplib or epoll\n";
+        return 1;
+    }
+    const std::string task_queue = flag("task-queue", "threadpool");
+    if (task_queue != "threadpool" && task_queue != "stealing")
+    {
+        std::cerr << "--task-queue must be threadpool or stealing\n";
+        return 1;
+    }
+    const std::size_t http_threads = std::stoul(flag("threads", std::to_string(CPPHTTPLIB_THREAD_POOL_COUNT)));
+    const std::string io = flag("io", "epoll");
+    if (io != "epoll" && io != "uring")
+    {
+        std::cerr << "--io must be epoll or uring\n";
+        return 1;
+    }
+
+    // Requests are split into a fast lane (cache hits, answered on the thread or loop that
+    // parsed them) and a bounded slow lane for anything that needs MySQL; work that does
+    // not fit in the slow lane is refused with 503 rather than queued behind it.
+    // Event loops (HTTP, memcached or RESP): blocking DB calls run on this pool unless the DB
+    // client is async; the httplib handlers never use it.
+    const int memcached_port = std::stoi(flag("memcached-port", "0"));
+    const int resp_port = std::stoi(flag("resp-port", "0"));
+    std::unique_ptr<WorkerPool> db_workers;
+    if ((frontend == "epoll" || memcached_port || resp_port) && !db.async_enabled())
+        db_workers = std::make_unique<WorkerPool>(std::stoul(flag("workers", "16")),
+                                                  std::stoul(flag("slow-lane-queue", "1024")));
+    KVService service(cache, db, db_workers.get());
+    // Large values are also cached gzip-compressed and sent that way to clients that
+    // accept it. 0 turns this off.
+    const std::size_t gzip_min_bytes = std::stoul(flag("gzip-min-bytes", "1024"));
+    if (flags.count("gzip-min-bytes") && gzip_min_bytes && !gzip::available())
+        std::cerr << "Built without zlib; --gzip-min-bytes ignored\n";
+    service.set_compression(gzip_min_bytes);
+    // Values of at least this size are kept LZ4-compressed in the cache. 0 turns this off.
+    const std::size_t cache_lz4_min_bytes = std::stoul(flag("cache-lz4-min-bytes", "0"));
+    service.set_cache_compression(cache_lz4_min_bytes);
+    // PUT bodies and values longer than this are streamed to and from MySQL in pieces
+    // and never cached. 0 turns this off.
+    const std::size_t stream_threshold = std::stoul(flag("stream-threshold", std::to_string(kStreamThreshold)));
+    service.set_stream_threshold(stream_threshold);
+
+    // Adaptive limit on DB-bound work for every front end: sheds with 503 as soon as
+    // latency shows MySQL queueing, instead of letting requests pile up behind it.
+    std::unique_ptr<AdmissionController> admission;
+    const std::string admission_mode = flag("admission", "gradient");
+    if (admission_mode == "gradient")
+    {
+        const std::size_t min_limit = std::stoul(flag("admission-min", "8"));
+        const std::size_t max_limit = std::stoul(flag("admission-max", "1024"));
+        admission = std::make_unique<AdmissionController>(std::max<std::size_t>(min_limit, 32), min_limit, max_limit);
+    }
+    else if (admission_mode != "off")
+    {
+        std::cerr << "--admission must be gradient or off\n";
+        return 1;
+    }
+    service.set_admission(admission.get());
+    // TTLs from RESP EXPIRE / SET EX, honoured by every front end.
+    ExpiryIndex expiry;
+    service.set_expiry(&expiry);
+    // httplib: cap the handler threads that may sit in MySQL, keeping the rest for hits.
+    auto slow_lane_limit = [&flag](std::size_t threads)
+    {
+        return std::stoul(flag("slow-lane", std::to_string(threads - std::max<std::size_t>(1, threads / 4))));
+    };
+    service.set_slow_lane_limit(slow_lane_limit(http_threads));
+
+    const std::size_t listeners = std::stoul(flag("listeners", "1"));
+    if (listeners > 1 && frontend != "httplib")
+    {
+        std::cerr << "--listeners needs --frontend=httplib\n";
+        return 1;
+    }
+
+    // --memcached-port and --resp-port serve the same store over the memcached text
+    // protocol and RESP2 from their own event loops, alongside whichever HTTP front end runs.
+    // --unix-socket=PATH also serves the HTTP API on a Unix domain socket for clients on
+    // the same host, through the same front end as the TCP port.
+    const std::string unix_socket = flag("unix-socket", "");
+    const std::size_t loops = std::stoul(flag("loops", std::to_string(std::max(1u, std::thread::hardware_concurrency()))));
+    const EventServer::Io event_io = io == "uring" ? EventServer::Io::Uring : EventServer::Io::Epoll;
+    struct ProtocolListener
+    {
+        const char *name;
+        int port;
+        std::unique_ptr<EventServer> server;
+        std::thread thread;
+        std::string path;
+    };
+    std::vector<ProtocolListener> protocol_listeners;
+    if (memcached_port)
+        protocol_listeners.push_back(ProtocolListener{"memcached", memcached_port,
+                                                      std::make_unique<EventServer>(service, loops, event_io, EventServer::Protocol::Memcached), {}, {}});
+    if (resp_port)
+        protocol_listeners.push_back(ProtocolListener{"RESP", resp_port,
+                                                      std::make_unique<EventServer>(service, loops, event_io, EventServer::Protocol::Resp), {}, {}});
+    if (!unix_socket.empty() && frontend == "epoll")
+        protocol_listeners.push_back(ProtocolListener{"HTTP", 0, std::make_unique<EventServer>(service, loops, event_io), {}, unix_socket});
+    // The httplib front end serves the socket from its own httplib server instead.
+    std::unique_ptr<httplib::Server> unix_svr;
+    std::thread unix_thread;
+    if (!unix_socket.empty() && frontend == "httplib")
+    {
+        unix_svr = std::make_unique<httplib::Server>();
+        unix_svr->set_address_family(AF_UNIX);
+        unix_svr->new_task_queue = task_queue_factory(task_queue, http_threads);
+        add_routes(*unix_svr, service);
+    }
+    auto start_protocol_listeners = [&]
+    {
+        for (ProtocolListener &l : protocol_listeners)
+        {
+            EventServer *server = l.server.get();
+            if (!l.path.empty())
+            {
+                std::cout << "Starting " << l.name << " listener at unix:" << l.path << " with " << loops << " " << io
+                          << " loop(s)\n";
+                l.thread = std::thread([server, path = l.path]
+                                       { server->listen_unix(path); });
+                continue;
+            }
+            std::cout << "Starting " << l.name << " listener at 0.0.0.0:" << l.port << " with " << loops << " " << io
+                      << " loop(s)\n";
+            const int listener_port = l.port;
+            l.thread = std::thread([server, listener_port]
+                                   { server->listen("0.0.0.0", listener_port); });
+        }
+        if (unix_svr)
+        {
+            std::cout << "Starting HTTP listener at unix:" << unix_socket << "\n";
+            // A socket file left by an earlier run would make bind fail.
+            unlink(unix_socket.c_str());
+            // httplib ignores the port for AF_UNIX but treats 0 as "pick one", which fails.
+            unix_thread = std::thread([&]
+                                      {
+                if (!unix_svr->listen(unix_socket, 80))
+                    std::cerr << "Cannot listen on " << unix_socket << "\n"; });
+        }
+    };
+    auto stop_protocol_listeners = [&]
+    {
+        for (ProtocolListener &l : protocol_listeners)
+        {
+            l.server->stop();
+            l.thread.join();
+        }
+        if (unix_svr)
+        {
+            unix_svr->stop();
+            unix_thread.join();
+            unlink(unix_socket.c_str());
+        }
+    };
+
+    // --listeners=N binds N httplib servers to the same port with SO_REUSEPORT, each
+    // pinned to its own core with its own accept thread and worker pool, so the kernel
+    // spreads connections and no accept loop or task queue is shared between cores.
+    if (listeners > 1)
+    {
+        const bool private_caches = flag("listener-cache", "shared") == "private";
+        const std::size_t threads = std::stoul(flag("listener-threads", "8"));
+        const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+
+        std::vector<std::unique_ptr<LRUCache<std::string, VersionedValue>>> shards;
+        std::vector<std::unique_ptr<KVService>> services;
+        std::vector<std::unique_ptr<httplib::Server>> servers;
+        for (std::size_t i = 0; i < listeners; ++i)
+        {
+            LRUCache<std::string, VersionedValue> *listener_cache = &cache;
+            if (private_caches)
+            {
+                shards.push_back(std::make_unique<LRUCache<std::string, VersionedValue>>(cache_entries, cache_bytes));
+                listener_cache = shards.back().get();
+            }
+            services.push_back(std::make_unique<KVService>(*listener_cache, db));
+            services.back()->set_slow_lane_limit(slow_lane_limit(threads));
+            services.back()->set_admission(admission.get());
+            services.back()->set_expiry(&expiry);
+            services.back()->set_compression(gzip_min_bytes);
+            services.back()->set_cache_compression(cache_lz4_min_bytes);
+            services.back()->set_stream_threshold(stream_threshold);
+
+            auto server = std::make_unique<httplib::Server>();
+            server->set_socket_options([](socket_t sock)
+                                       {
+                int yes = 1;
+                setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+                setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)); });
+            server->new_task_queue = task_queue_factory(task_queue, threads);
+            add_routes(*server, *services.back());
+            servers.push_back(std::move(server));
+        }
+        // A private cache only sees its own listener's writes, so every write also
+        // evicts the key from the sibling caches.
+        for (std::size_t i = 0; private_caches && i < listeners; ++i)
+        {
+            std::vector<LRUCache<std::string, VersionedValue> *> peers;
+            for (std::size_t j = 0; j < listeners; ++j)
+            {
+                if (j != i)
+                    peers.push_back(shards[j].get());
+            }
+            // The memcached, RESP and unix socket listeners keep using the shared cache.
+            if (!protocol_listeners.empty() || unix_svr)
+                peers.push_back(&cache);
+            services[i]->set_peers(std::move(peers));
+        }
+        if ((!protocol_listeners.empty() || unix_svr) && private_caches)
+        {
+            std::vector<LRUCache<std::string, VersionedValue> *> peers;
+            for (auto &shard : shards)
+                peers.push_back(shard.get());
+            service.set_peers(std::move(peers));
+        }
+        start_protocol_listeners();
+
+        std::cout << "Starting " << listeners << " SO_REUSEPORT listeners at 0.0.0.0:" << port << " with "
+                  << threads << " worker(s) each and " << (private_caches ? "per-listener" : "a shared") << " cache\n";
+        std::vector<std::thread> accept_threads;
+        for (std::size_t i = 0; i < listeners; ++i)
+        {
+            accept_threads.emplace_back([&servers, i, cores, port]
+                                        {
+                // The worker pool is created on this thread inside listen(), so it inherits the pin.
+                pin_to_core(static_cast<unsigned>(i % cores));
+                if (!servers[i]->listen("0.0.0.0", port))
+                    std::cerr << "Listener " << i << " failed to bind port " << port << "\n"; });
+        }
+        for (auto &t : accept_threads)
+            t.join();
+        stop_protocol_listeners();
+        return 0;
+    }
+
+    httplib::Server svr;
+    svr.new_task_queue = task_queue_factory(task_queue, http_threads);
+    add_routes(svr, service);
+
+    if (frontend == "epoll")
+    {
+        const int admin_port = std::stoi(flag("admin-port", std::to_string(port + 1)));
+        std::thread admin([&]
+                          { svr.listen("0.0.0.0", admin_port); });
+        start_protocol_listeners();
+
+        EventServer events(service, loops, event_io);
+        std::cout << "Starting event server at 0.0.0.0:" << port << " with " << loops << " " << io << " loop(s); "
+                  << "scan/export/import on 0.0.0.0:" << admin_port << "\n";
+        bool ok = events.listen("0.0.0.0", port);
+        svr.stop();
+        admin.join();
+        stop_protocol_listeners();
+        return ok ? 0 : 1;
+    }
+
+    start_protocol_listeners();
+    std::cout << "Starting server at 0.0.0.0:" << port << "\n";
+    svr.listen("0.0.0.0", port);
+    stop_protocol_listeners();
     return 0;
 }
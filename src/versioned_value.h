@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <utility>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include "lz4_block.h"
+#include "request_arena.h"
+
+// A value and the version it was written with. Versions are stored in kv_store.ver
+// and in cache entries; HTTP serves them as ETags and memcached as CAS ids.
+struct VersionedValue
+{
+    VersionedValue() = default;
+    VersionedValue(std::string value_, std::uint64_t version_) : value(std::move(value_)), version(version_) {}
+
+    std::string value;
+    std::uint64_t version = 0;
+    // The value gzip-compressed, kept alongside it in the cache when it is large
+    // enough and shrinks; shared so a response can be sent straight from it.
+    std::shared_ptr<const std::string> gzipped;
+    // Nonzero while `value` holds the value LZ4-compressed (see pack()): its size
+    // uncompressed. Only cache entries are packed; KVService unpacks on the way out.
+    std::uint32_t raw_size = 0;
+};
+
+// Rough cost of a cache entry beyond its bytes: LRUCache's list and hash nodes and
+// the string headers.
+static const std::size_t kCacheEntryOverhead = 160;
+
+// Bytes a cache entry is charged against the cache's byte budget: the key, held by
+// both the list and the index, the value as stored, and its gzip form.
+inline std::size_t cache_charge(const std::string &key, const VersionedValue &entry)
+{
+    return kCacheEntryOverhead + 2 * key.size() + entry.value.size() + (entry.gzipped ? entry.gzipped->size() : 0);
+}
+
+// LZ4-compresses entry.value in place if it is at least `min_bytes` long and
+// shrinks by at least an eighth. Returns whether it did.
+inline bool pack(VersionedValue &entry, std::size_t min_bytes)
+{
+    const std::size_t size = entry.value.size();
+    if (entry.raw_size || size < min_bytes || size > UINT32_MAX)
+        return false;
+    request_arena::Buffer buffer(lz4::compress_bound(size));
+    const std::size_t packed = lz4::compress(entry.value.data(), size, buffer.data(), buffer.size());
+    if (packed == 0 || packed > size - size / 8)
+        return false;
+    // A fresh string, so the cache does not keep the raw value's capacity.
+    entry.value = std::string(buffer.data(), packed);
+    entry.raw_size = static_cast<std::uint32_t>(size);
+    return true;
+}
+
+// Undoes pack(). False if the packed bytes are corrupt.
+inline bool unpack(VersionedValue &entry)
+{
+    if (!entry.raw_size)
+        return true;
+    std::string raw(entry.raw_size, '\0');
+    if (!lz4::decompress(entry.value.data(), entry.value.size(), &raw[0], raw.size()))
+        return false;
+    entry.value = std::move(raw);
+    entry.raw_size = 0;
+    return true;
+}
+
+// Hybrid timestamp: microseconds since the Unix epoch, but always past the last
+// version this process handed out, so versions keep increasing if the clock stalls
+// or steps back. Rows written before versions existed have version 0.
+inline std::uint64_t next_version()
+{
+    static std::atomic<std::uint64_t> last{0};
+    const std::uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::system_clock::now().time_since_epoch())
+                                  .count();
+    std::uint64_t prev = last.load(std::memory_order_relaxed);
+    std::uint64_t next;
+    do
+    {
+        next = std::max(now, prev + 1);
+    } while (!last.compare_exchange_weak(prev, next, std::memory_order_relaxed));
+    return next;
+}
@@ -0,0 +1,204 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include "httplib.h"
+
+// httplib::TaskQueue with one bounded lane per worker instead of ThreadPool's single
+// mutex-guarded list. The accept thread deals connections round-robin across the
+// lanes; a worker drains its own lane and steals from the others when it runs dry.
+// Lanes are preallocated rings of std::function slots, so enqueueing allocates
+// nothing (httplib's task fits std::function's inline storage), and the mutex is
+// only touched to park or wake idle workers.
+class WorkStealingQueue final : public httplib::TaskQueue
+{
+public:
+    static const std::size_t kLaneCapacity = 1024; // per worker, a power of two
+
+    explicit WorkStealingQueue(std::size_t threads)
+    {
+        const std::size_t count = threads ? threads : 1;
+        lanes.reserve(count);
+        for (std::size_t i = 0; i < count; ++i)
+            lanes.push_back(std::make_unique<Lane>());
+        for (std::size_t i = 0; i < count; ++i)
+            workers.emplace_back([this, i]
+                                 { run(i); });
+    }
+
+    ~WorkStealingQueue() override
+    {
+        if (!workers.empty())
+            shutdown();
+    }
+
+    WorkStealingQueue(const WorkStealingQueue &) = delete;
+    WorkStealingQueue &operator=(const WorkStealingQueue &) = delete;
+
+    // Returns false only when every lane is full; httplib then drops the connection.
+    bool enqueue(std::function<void()> fn) override
+    {
+        const std::size_t start = next_lane.fetch_add(1, std::memory_order_relaxed);
+        bool queued = false;
+        for (std::size_t i = 0; i < lanes.size() && !queued; ++i)
+            queued = lanes[(start + i) % lanes.size()]->push(fn);
+        if (!queued)
+            return false;
+
+        // Pairs with the fence in run(): either the worker sees the task, or we see it parked.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0)
+        {
+            {
+                std::lock_guard<std::mutex> lock(park_mu);
+                if (wakeups < sleepers.load(std::memory_order_relaxed))
+                    ++wakeups;
+            }
+            park_cv.notify_one();
+        }
+        return true;
+    }
+
+    void shutdown() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(park_mu);
+            stopping = true;
+        }
+        park_cv.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+private:
+    // Bounded MPMC ring (Vyukov): each slot's sequence number hands it alternately to
+    // one producer and one consumer, so a slot's std::function is never touched by
+    // two threads at once even though pushes and steals race on the indices.
+    class Lane
+    {
+    public:
+        Lane() : slots(new Slot[kLaneCapacity])
+        {
+            for (std::size_t i = 0; i < kLaneCapacity; ++i)
+                slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        bool push(std::function<void()> &fn)
+        {
+            std::size_t pos = head.load(std::memory_order_relaxed);
+            Slot *slot;
+            for (;;)
+            {
+                slot = &slots[pos & (kLaneCapacity - 1)];
+                const std::size_t seq = slot->seq.load(std::memory_order_acquire);
+                const std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+                if (diff == 0 && head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+                if (diff < 0)
+                    return false; // full
+                if (diff > 0)
+                    pos = head.load(std::memory_order_relaxed);
+            }
+            slot->fn = std::move(fn);
+            slot->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(std::function<void()> &fn)
+        {
+            std::size_t pos = tail.load(std::memory_order_relaxed);
+            Slot *slot;
+            for (;;)
+            {
+                slot = &slots[pos & (kLaneCapacity - 1)];
+                const std::size_t seq = slot->seq.load(std::memory_order_acquire);
+                const std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+                if (diff == 0 && tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+                if (diff < 0)
+                    return false; // empty
+                if (diff > 0)
+                    pos = tail.load(std::memory_order_relaxed);
+            }
+            fn = std::move(slot->fn);
+            slot->fn = nullptr;
+            slot->seq.store(pos + kLaneCapacity, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        struct Slot
+        {
+            std::atomic<std::size_t> seq;
+            std::function<void()> fn;
+        };
+
+        alignas(64) std::atomic<std::size_t> head{0};
+        alignas(64) std::atomic<std::size_t> tail{0};
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    // Own lane first, then the others in order.
+    bool take(std::size_t self, std::function<void()> &fn)
+    {
+        for (std::size_t i = 0; i < lanes.size(); ++i)
+        {
+            if (lanes[(self + i) % lanes.size()]->pop(fn))
+                return true;
+        }
+        return false;
+    }
+
+    void run(std::size_t self)
+    {
+        std::function<void()> task;
+        for (;;)
+        {
+            if (take(self, task))
+            {
+                task();
+                task = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(park_mu);
+            sleepers.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (take(self, task))
+            {
+                sleepers.fetch_sub(1, std::memory_order_relaxed);
+                lock.unlock();
+                task();
+                task = nullptr;
+                continue;
+            }
+            if (stopping)
+            {
+                sleepers.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            park_cv.wait(lock, [this]
+                         { return wakeups > 0 || stopping; });
+            if (wakeups > 0)
+                --wakeups;
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> next_lane{0};
+
+    std::atomic<std::size_t> sleepers{0};
+    std::mutex park_mu;
+    std::condition_variable park_cv;
+    std::size_t wakeups = 0; // guarded by park_mu
+    bool stopping = false;   // guarded by park_mu
+};
@@ -0,0 +1,75 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstddef>
+
+// Plain fixed-size thread pool for blocking work handed off by the event loops.
+// With max_queued > 0, submit() refuses work once that many tasks are waiting.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(std::size_t threads, std::size_t max_queued = 0)
+        : max_queued(max_queued)
+    {
+        const std::size_t count = threads ? threads : 1;
+        for (std::size_t i = 0; i < count; ++i)
+            workers.emplace_back([this]
+                                 { run(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    bool submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (max_queued && tasks.size() >= max_queued)
+                return false;
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+        return true;
+    }
+
+private:
+    void run()
+    {
+        for (;;)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                cv.wait(lock, [this]
+                        { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::size_t max_queued;
+    bool stopping = false;
+};